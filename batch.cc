@@ -0,0 +1,365 @@
+#include "gazosan.h"
+
+#include <filesystem>
+#include <iomanip>
+#include <map>
+#include <set>
+
+namespace gazosan {
+
+static Counter num_batch_pairs("batch_pairs");
+static Counter num_unchanged_pairs("unchanged_pairs");
+
+// The steps of comparing a pair, which run_batch runs as pipeline
+// stages. Each returns false when the pair is done early: its result was
+// reused, or it cannot be compared and `error` says why.
+using PairStage = bool (*)(Context& ctx, std::optional<std::string>& error);
+
+static bool read_pair(Context& ctx, std::optional<std::string>& error)
+{
+    // the disk reads overlap with the work on the pairs ahead of this one
+    auto open = [&](const std::string& path, std::unique_ptr<MappedFile<Context>>& file) {
+        if (!file)
+            file.reset(MappedFile<Context>::open(ctx, path));
+        if (!file) {
+            error = "cannot open " + path + ": " + std::string(errno_string());
+            return false;
+        }
+        file->prefetch();
+        return true;
+    };
+    if (!open(ctx.arg.new_file, ctx.new_file))
+        return false;
+    if (!ctx.old_prepared && !ctx.arg.old_file.empty() && !open(ctx.arg.old_file, ctx.old_file))
+        return false;
+    return ctx.arg.cache_dir.empty() || !reuse_result(ctx);
+}
+
+static bool decode_pair(Context& ctx, std::optional<std::string>& error)
+{
+    error = load_image(ctx);
+    if (error)
+        return false;
+
+    const std::variant<bool, std::string> diff_check = check_histogram_differential(ctx);
+    if (!std::holds_alternative<bool>(diff_check))
+        error = std::get<std::string>(diff_check);
+    else
+        ctx.unchanged = std::get<bool>(diff_check);
+    return !error && !ctx.unchanged;
+}
+
+static bool segment_pair(Context& ctx, std::optional<std::string>&)
+{
+    detect_segments(ctx);
+    // save_segments(ctx);
+    return true;
+}
+
+static bool match_pair(Context& ctx, std::optional<std::string>&)
+{
+    match_segments(ctx);
+    return true;
+}
+
+static bool encode_pair(Context& ctx, std::optional<std::string>& error)
+{
+    // a missing or partial output must not be journaled
+    error = write_diff_images(ctx);
+    if (error)
+        return false;
+    if (!ctx.arg.cache_dir.empty())
+        record_result(ctx);
+    return true;
+}
+
+static constexpr struct {
+    const char* name;
+    PairStage run;
+} pair_stages[] = {
+    { "read", read_pair },
+    { "decode", decode_pair },
+    { "segment", segment_pair },
+    { "match", match_pair },
+    { "encode", encode_pair },
+};
+
+// Compares ctx.arg.old_file (or the old side prepared already) with
+// ctx.arg.new_file and writes the output images. Returns the reason the pair
+// could not be compared instead of exiting. A single comparison of two
+// identical images is an error, as it always was; batches report such
+// pairs as unchanged instead.
+std::optional<std::string> compare_images(Context& ctx)
+{
+    std::optional<std::string> error;
+    for (const auto& stage : pair_stages) {
+        if (!stage.run(ctx, error))
+            break;
+    }
+    if (ctx.unchanged)
+        return "two images are same";
+    return error;
+}
+
+// A pair of a batch. Without `old_file`, it shares the old side of the
+// context of the batch.
+struct BatchPair {
+    std::string name; // for messages
+    std::string old_file;
+    std::string new_file;
+    std::string output_name;
+};
+
+// A shared old side is referenced; matching keeps its state per pair, in
+// old_matched. `base` must outlive the context.
+static std::unique_ptr<Context> pair_context(const Context& base, const BatchPair& pair)
+{
+    auto ctx = std::make_unique<Context>();
+    ctx->arg = base.arg;
+    ctx->arg.new_files.clear();
+    ctx->arg.new_file = pair.new_file;
+    ctx->arg.output_name = pair.output_name;
+    ctx->cmdline_args = base.cmdline_args;
+    ctx->limits = base.limits;
+    ctx->descriptor_tile_size = base.descriptor_tile_size;
+    ctx->features = base.features;
+
+    if (!pair.old_file.empty()) {
+        ctx->arg.old_file = pair.old_file;
+        return ctx;
+    }
+    ctx->old_prepared = true;
+    ctx->old_hash = base.old_hash;
+    ctx->old_color_mat = base.old_color_mat;
+    ctx->old_gray_mat = base.old_gray_mat;
+    ctx->old_segments = base.old_segments;
+    ctx->old_descriptors = base.old_descriptors.view();
+    return ctx;
+}
+
+// asks the kernel to read `path` into the page cache in the background
+static void readahead(const std::string& path)
+{
+#ifdef POSIX_FADV_WILLNEED
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+}
+
+// Where the pairs of a batch spend their time. A stage whose queue keeps
+// growing is the bottleneck; one which is mostly waiting is starved.
+struct StageStats {
+    std::atomic<i64> pairs = 0;
+    std::atomic<i64> busy = 0; // nsec
+    std::atomic<i64> waiting = 0; // nsec between the previous stage and this one
+    std::atomic<i64> queued = 0; // pairs done with the previous stage, not started here
+    std::atomic<i64> max_queued = 0;
+};
+
+static void print_stage_stats(const std::vector<StageStats>& stats)
+{
+    std::cout << std::setw(10) << "stage" << std::setw(8) << "pairs" << std::setw(10) << "busy" << std::setw(10) << "wait"
+              << std::setw(11) << "max_queue" << "\n";
+    for (std::size_t s = 0; s < stats.size(); s++) {
+        std::cout << std::setw(10) << pair_stages[s].name << std::setw(8) << stats[s].pairs.load() << std::fixed << std::setprecision(3)
+                  << std::setw(10) << static_cast<double>(stats[s].busy) / 1000000000 << std::setw(10)
+                  << static_cast<double>(stats[s].waiting) / 1000000000 << std::setw(11) << stats[s].max_queued.load() << "\n";
+    }
+    std::cout << std::flush;
+}
+
+// Runs `batch` through pair_stages as a pipeline, so that one pair is read
+// while others are decoded or matched, with at most -max_in_flight of them in
+// memory. The files of the next pairs are read ahead: with io_uring into
+// memory, otherwise into the page cache.
+static bool run_batch(Context& ctx, const std::vector<BatchPair>& batch)
+{
+    Timer t(ctx, "run batch");
+    const std::size_t n = batch.size();
+    const std::size_t ahead = static_cast<std::size_t>(ctx.arg.max_in_flight);
+    constexpr std::size_t num_stages = std::size(pair_stages);
+
+    std::unique_ptr<FileLoader> loader;
+    std::vector<std::size_t> first_file(n); // of the pair in the loader
+    if (ctx.arg.io_uring) {
+        std::vector<std::string> paths;
+        for (std::size_t i = 0; i < n; i++) {
+            first_file[i] = paths.size();
+            if (!batch[i].old_file.empty())
+                paths.push_back(batch[i].old_file);
+            paths.push_back(batch[i].new_file);
+        }
+        loader = FileLoader::create(std::move(paths), static_cast<i64>(ahead) * 2);
+    }
+
+    std::vector<std::unique_ptr<Context>> pairs(n);
+    std::vector<std::optional<std::string>> errors(n);
+    std::vector<char> done(n); // the remaining stages are skipped
+    std::vector<char> unchanged(n);
+    std::vector<i64> ready(n); // when the previous stage finished
+    std::vector<StageStats> stats(num_stages);
+
+    std::vector<std::function<void(i64)>> stages;
+    for (std::size_t s = 0; s < num_stages; s++) {
+        stages.emplace_back([&, s](const i64 i) {
+            const i64 start = now_nsec();
+            if (s == 0) {
+                pairs[i] = pair_context(ctx, batch[i]);
+                if (loader) {
+                    // a file which could not be read is opened again by
+                    // read_pair, to report why
+                    std::size_t f = first_file[i];
+                    if (!batch[i].old_file.empty())
+                        pairs[i]->old_file.reset(loader->take(f++));
+                    pairs[i]->new_file.reset(loader->take(f));
+                } else {
+                    for (std::size_t j = i == 0 ? 1 : i + ahead; j <= i + ahead && j < n; j++) {
+                        if (!batch[j].old_file.empty())
+                            readahead(batch[j].old_file);
+                        readahead(batch[j].new_file);
+                    }
+                }
+            } else {
+                stats[s].queued--;
+                stats[s].waiting += start - ready[i];
+            }
+
+            if (!done[i]) {
+                done[i] = !pair_stages[s].run(*pairs[i], errors[i]);
+                stats[s].pairs++;
+            }
+
+            const i64 end = now_nsec();
+            stats[s].busy += end - start;
+            if (s + 1 < num_stages) {
+                ready[i] = end;
+                const i64 queued = ++stats[s + 1].queued;
+                for (i64 max = stats[s + 1].max_queued; queued > max && !stats[s + 1].max_queued.compare_exchange_weak(max, queued);) { }
+            } else {
+                // the images and the diff are not needed any more
+                if (loader) {
+                    for (const std::unique_ptr<MappedFile<Context>>* file : { &pairs[i]->old_file, &pairs[i]->new_file }) {
+                        if (*file)
+                            loader->recycle(**file);
+                    }
+                }
+                unchanged[i] = pairs[i]->unchanged;
+                pairs[i].reset();
+                num_batch_pairs++;
+            }
+        });
+    }
+    parallel_pipeline(static_cast<i64>(n), ctx.arg.max_in_flight, stages);
+
+    if (ctx.arg.perf)
+        print_stage_stats(stats);
+
+    // unchanged pairs are a result, not a failure
+    bool ok = true;
+    for (std::size_t i = 0; i < n; i++) {
+        if (unchanged[i]) {
+            SyncOut(ctx) << "unchanged: " << batch[i].name;
+            num_unchanged_pairs++;
+        }
+        if (errors[i]) {
+            SyncOut(ctx, std::cerr) << add_color(ctx, "error") << batch[i].name << ": " << *errors[i];
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// Fan-out: the old image is loaded, segmented and described once, then
+// compared against every -new. The outputs of a candidate are named after
+// the output prefix and the candidate's file name, plus its position in
+// -new where that name is not unique, e.g. for 'variants/*/shot.png'.
+bool compare_candidates(Context& ctx)
+{
+    Timer t(ctx, "compare candidates");
+    {
+        Timer t2(ctx, "prepare old image", &t);
+        if (const std::optional<std::string> error = load_image(ctx))
+            Fatal(ctx) << *error;
+        if (ctx.old_color_mat.empty())
+            Fatal(ctx) << ctx.arg.old_file << ": cannot decode the image";
+        detect_segments(ctx);
+        if (!ctx.arg.cache_dir.empty())
+            old_input_hash(ctx);
+    }
+
+    std::map<std::string, i64> stems;
+    for (const std::string& file : ctx.arg.new_files)
+        stems[std::filesystem::path(file).stem().string()]++;
+
+    // pairs with the same output names would overwrite each other's images
+    std::vector<BatchPair> batch;
+    std::set<std::string> names;
+    for (std::size_t i = 0; i < ctx.arg.new_files.size(); i++) {
+        const std::string& file = ctx.arg.new_files[i];
+        std::string name = std::filesystem::path(file).stem().string();
+        if (stems[name] > 1)
+            name += "_" + std::to_string(i + 1);
+        while (names.contains(name))
+            name += "_" + std::to_string(i + 1);
+        names.insert(name);
+        batch.push_back({ file, "", file, ctx.arg.output_name + "_" + name });
+    }
+    return run_batch(ctx, batch);
+}
+
+static bool is_image_file(const std::filesystem::path& path)
+{
+    static const std::set<std::string> extensions = { ".bmp", ".jpeg", ".jpg", ".pgm", ".png", ".pnm", ".ppm", ".qoi", ".tif", ".tiff", ".webp" };
+    std::string ext = path.extension().string();
+    std::ranges::transform(ext, ext.begin(), [](const unsigned char c) { return std::tolower(c); });
+    return extensions.contains(ext);
+}
+
+// relative paths of the images under `dir`
+static std::set<std::string> list_images(Context& ctx, const std::string& dir)
+{
+    std::error_code ec;
+    std::set<std::string> paths;
+    for (auto it = std::filesystem::recursive_directory_iterator(dir, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_regular_file(ec) && is_image_file(it->path()))
+            paths.insert(std::filesystem::relative(it->path(), dir, ec).string());
+    }
+    if (ec)
+        Fatal(ctx) << dir << ": " << ec.message();
+    return paths;
+}
+
+// Pairs the images of -old_dir and -new_dir by their relative paths, reports
+// the ones found on one side only and compares the others. The outputs go to
+// <output>/<relative path>_*; the extension stays, as a/b.png and a/b.jpg
+// are different pairs.
+bool compare_directories(Context& ctx)
+{
+    Timer t(ctx, "compare directories");
+    const std::set<std::string> old_paths = list_images(ctx, ctx.arg.old_dir);
+    const std::set<std::string> new_paths = list_images(ctx, ctx.arg.new_dir);
+
+    std::vector<BatchPair> batch;
+    for (const std::string& path : old_paths) {
+        if (!new_paths.contains(path)) {
+            std::cout << "removed: " << path << "\n";
+            continue;
+        }
+        const std::filesystem::path output = std::filesystem::path(ctx.arg.output_name) / path;
+        std::error_code ec;
+        std::filesystem::create_directories(output.parent_path(), ec);
+        batch.push_back({ path, ctx.arg.old_dir + "/" + path, ctx.arg.new_dir + "/" + path, output.string() });
+    }
+    for (const std::string& path : new_paths) {
+        if (!old_paths.contains(path))
+            std::cout << "added: " << path << "\n";
+    }
+    std::cout << std::flush;
+
+    return run_batch(ctx, batch);
+}
+
+} // namespace gazosan
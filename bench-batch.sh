@@ -0,0 +1,114 @@
+#!/bin/bash
+#
+# Compares gazosan configurations on a directory batch, by default the
+# file loaders, on a cold page cache.
+#
+# usage: bench-batch.sh <gazosan> <corpus> [options...]
+#
+# <corpus>/old and <corpus>/new are compared with -old_dir/-new_dir. Each
+# argument after the corpus is one configuration, a string of gazosan
+# options, e.g.
+#
+#   bench-batch.sh ./build/gazosan corpus "-loader mmap" "-loader io_uring"
+#
+# The page cache is dropped before every run, which needs root. Set
+# RUNS to repeat each configuration; the fastest run is reported. For every
+# configuration this prints the throughput and the ratio of compared pairs
+# whose diff image is identical to the one produced by the first
+# configuration. Pairs of identical images are not compared and not counted.
+# A configuration which fails is reported, and makes the script exit 1.
+
+set -e
+
+gazosan=$(realpath "$1")
+corpus=$2
+shift 2
+if [ $# -eq 0 ]; then
+  set -- "-loader mmap" "-loader io_uring"
+fi
+runs=${RUNS:-3}
+
+if [ -w /proc/sys/vm/drop_caches ]; then
+  cold=1
+else
+  echo "cannot drop the page cache without root; timing a warm cache" >&2
+  cold=0
+fi
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+# the relative paths of the pairs, as the batch pairs them
+pairs_file="$out/pairs"
+(cd "$corpus/old" && find . -type f -print0) | while IFS= read -r -d '' path; do
+  path=${path#./}
+  case "${path,,}" in
+    *.bmp | *.jpeg | *.jpg | *.pgm | *.png | *.pnm | *.ppm | *.qoi | *.tif | *.tiff | *.webp) ;;
+    *) continue ;;
+  esac
+  [ -f "$corpus/new/$path" ] && printf '%s\0' "$path"
+done > "$pairs_file"
+
+printf "%-24s %6s %9s %9s %10s\n" options pairs seconds pairs/s agreement
+
+status=0
+run=0
+for options in "$@"; do
+  dir="$out/$run"
+  best=0
+  failed=0
+
+  for i in $(seq "$runs"); do
+    rm -rf "$dir"
+    mkdir -p "$dir"
+    if [ $cold = 1 ]; then
+      sync
+      echo 3 > /proc/sys/vm/drop_caches
+    fi
+
+    start=$(date +%s%N)
+    rc=0
+    "$gazosan" -old_dir "$corpus/old" -new_dir "$corpus/new" $options -o "$dir" > "$out/stdout" 2> "$out/stderr" || rc=$?
+    end=$(date +%s%N)
+    if [ $rc != 0 ]; then
+      failed=$rc
+      break
+    fi
+    if [ $best = 0 ] || [ $((end - start)) -lt $best ]; then
+      best=$((end - start))
+    fi
+  done
+
+  if [ $failed != 0 ]; then
+    printf "%-24s failed with exit status %d:\n" "$options" "$failed"
+    sed 's/^/  /' "$out/stderr"
+    status=1
+    # without the first configuration there is nothing to agree with
+    [ $run = 0 ] && exit 1
+    run=$((run + 1))
+    continue
+  fi
+
+  if [ $run = 0 ]; then
+    sed -n 's/^unchanged: //p' "$out/stdout" > "$out/unchanged"
+  fi
+
+  pairs=0
+  agree=0
+  while IFS= read -r -d '' path; do
+    grep -qxF -- "$path" "$out/unchanged" && continue
+    pairs=$((pairs + 1))
+    a="$out/0/${path}_diff.png"
+    b="$dir/${path}_diff.png"
+    if [ -e "$a" ] && [ -e "$b" ] && cmp -s "$a" "$b"; then
+      agree=$((agree + 1))
+    fi
+  done < "$pairs_file"
+
+  awk -v o="$options" -v n=$pairs -v ns=$best -v agree=$agree 'BEGIN {
+    s = ns / 1e9
+    printf "%-24s %6d %9.3f %9.2f %9.1f%%\n", o, n, s, (s > 0 ? n / s : 0), (n > 0 ? 100 * agree / n : 0)
+  }'
+  run=$((run + 1))
+done
+exit $status
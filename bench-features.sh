@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Compares gazosan configurations on a corpus of image pairs.
+#
+# usage: bench-features.sh <gazosan> <corpus> [options...]
+#
+# <corpus>/old/NAME.png is paired with <corpus>/new/NAME.png. Each argument
+# after the corpus is one configuration, a string of gazosan options, e.g.
+#
+#   bench-features.sh ./build/gazosan corpus "-features orb" "-max_keypoints 0"
+#
+# For every configuration this prints the throughput and the ratio of pairs
+# whose diff image is identical to the one produced by the baseline: the
+# default options, or the options in BASELINE.
+
+set -e
+
+gazosan=$(realpath "$1")
+corpus=$2
+shift 2
+if [ $# -eq 0 ]; then
+  set -- "-features orb" "-features brisk" "-features phash"
+fi
+
+baseline=${BASELINE:-}
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+printf "%-36s %6s %9s %9s %10s\n" options pairs seconds pairs/s agreement
+
+run=0
+for options in "$baseline" "$@"; do
+  dir="$out/$run"
+  mkdir -p "$dir"
+  pairs=0
+  agree=0
+
+  start=$(date +%s%N)
+  for old in "$corpus"/old/*.png; do
+    name=$(basename "$old" .png)
+    new="$corpus/new/$name.png"
+    [ -f "$new" ] || continue
+
+    # identical pairs exit with an error and produce no output
+    "$gazosan" -old "$old" -new "$new" $options -o "$dir/$name" > /dev/null 2>&1 || true
+    pairs=$((pairs + 1))
+  done
+  end=$(date +%s%N)
+
+  for old in "$corpus"/old/*.png; do
+    name=$(basename "$old" .png)
+    [ -f "$corpus/new/$name.png" ] || continue
+
+    a="$out/0/${name}_diff.png"
+    b="$dir/${name}_diff.png"
+    if [ ! -e "$a" ] && [ ! -e "$b" ]; then
+      agree=$((agree + 1))
+    elif [ -e "$a" ] && [ -e "$b" ] && cmp -s "$a" "$b"; then
+      agree=$((agree + 1))
+    fi
+  done
+
+  awk -v o="${options:-(default)}" -v n=$pairs -v ns=$((end - start)) -v agree=$agree 'BEGIN {
+    s = ns / 1e9
+    printf "%-36s %6d %9.3f %9.2f %9.1f%%\n", o, n, s, (s > 0 ? n / s : 0), (n > 0 ? 100 * agree / n : 0)
+  }'
+  run=$((run + 1))
+done
@@ -0,0 +1,17 @@
+#!/bin/bash
+#
+# Compares the descriptor matchers against FLANN, the matcher of previous
+# versions, on a corpus of image pairs laid out as for bench-features.sh.
+#
+# usage: bench-matchers.sh <gazosan> <corpus> [features]
+#
+# For the given feature backend (default: akaze) this prints the throughput
+# of -matcher flann, hamming and l2, and the ratio of pairs whose diff image
+# is identical to the one FLANN produces.
+
+set -e
+
+dir=$(dirname "$0")
+features=${3:-akaze}
+BASELINE="-features $features -matcher flann" exec "$dir/bench-features.sh" "$1" "$2" \
+  "-features $features -matcher hamming" "-features $features -matcher l2"
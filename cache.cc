@@ -0,0 +1,314 @@
+#include "gazosan.h"
+
+#include <charconv>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <set>
+
+#include <sys/stat.h>
+
+namespace gazosan {
+
+// Layout: FileHeader, a SectionEntry per section, then the sections, each
+// starting at a page boundary so that they can be used in place.
+struct FileHeader {
+    char magic[8];
+    u32 version;
+    u32 num_sections;
+    u64 key;
+    u64 reserved;
+};
+
+struct SectionEntry {
+    u32 tag;
+    u32 reserved;
+    u64 offset;
+    u64 size;
+};
+
+static constexpr char section_file_magic[8] = { 'G', 'A', 'Z', 'O', 'S', 'A', 'N', 0 };
+static constexpr u64 section_alignment = 4096;
+
+static u64 align_to(const u64 value, const u64 alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+u64 hash_bytes(const void* data, const std::size_t size, const u64 seed)
+{
+    constexpr u64 prime = 0x9e3779b97f4a7c15ULL;
+    auto mix = [](u64 h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    };
+
+    const u8* p = static_cast<const u8*>(data);
+    u64 h = mix(seed ^ size);
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        u64 word;
+        std::memcpy(&word, p + i, 8);
+        h = (h ^ mix(word)) * prime;
+    }
+    u64 tail = 0;
+    std::memcpy(&tail, p + i, size - i);
+    return mix((h ^ mix(tail)) * prime);
+}
+
+std::string hex_string(const u64 value)
+{
+    std::stringstream ss;
+    ss << std::hex << std::setw(16) << std::setfill('0') << value;
+    return ss.str();
+}
+
+void SectionWriter::add(const u32 tag, const void* data, const std::size_t size)
+{
+    sections.push_back({ tag, data, size });
+}
+
+bool SectionWriter::write(const std::string& path, const u64 key) const
+{
+    std::vector<SectionEntry> entries;
+    u64 offset = align_to(sizeof(FileHeader) + sections.size() * sizeof(SectionEntry), section_alignment);
+    for (const Section& s : sections) {
+        entries.push_back({ s.tag, 0, offset, s.size });
+        offset = align_to(offset + s.size, section_alignment);
+    }
+
+    FileHeader header {};
+    std::memcpy(header.magic, section_file_magic, sizeof(header.magic));
+    header.version = section_file_version;
+    header.num_sections = static_cast<u32>(sections.size());
+    header.key = key;
+
+    // written aside and renamed into place, so that concurrent readers
+    // never see a partial file. Each writer has a file of its own: threads
+    // of one process may write the same entry at once.
+    std::string tmp = path + ".tmp.XXXXXX";
+    const int fd = mkstemp(tmp.data());
+    if (fd == -1)
+        return false;
+    fchmod(fd, 0644);
+
+    auto write_at = [&](const void* data, const std::size_t size, const u64 at) {
+        const char* p = static_cast<const char*>(data);
+        for (std::size_t done = 0; done < size;) {
+            const ssize_t n = pwrite(fd, p + done, size - done, static_cast<off_t>(at + done));
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+        return true;
+    };
+
+    bool ok = write_at(&header, sizeof(header), 0) && write_at(entries.data(), entries.size() * sizeof(SectionEntry), sizeof(header));
+    for (std::size_t i = 0; ok && i < sections.size(); i++)
+        ok = write_at(sections[i].data, sections[i].size, entries[i].offset);
+    ok = ok && ftruncate(fd, static_cast<off_t>(offset)) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<SectionReader> SectionReader::open(Context& ctx, const std::string& path, const u64 key)
+{
+    std::unique_ptr<MappedFile<Context>> file(MappedFile<Context>::open(ctx, path));
+    if (!file || file->size < static_cast<i64>(sizeof(FileHeader)))
+        return nullptr;
+
+    FileHeader header {};
+    std::memcpy(&header, file->data, sizeof(header));
+    if (std::memcmp(header.magic, section_file_magic, sizeof(header.magic)) != 0 || header.version != section_file_version || header.key != key)
+        return nullptr;
+    if (sizeof(FileHeader) + static_cast<u64>(header.num_sections) * sizeof(SectionEntry) > static_cast<u64>(file->size))
+        return nullptr;
+
+    auto reader = std::make_unique<SectionReader>();
+    for (u32 i = 0; i < header.num_sections; i++) {
+        SectionEntry e {};
+        std::memcpy(&e, file->data + sizeof(FileHeader) + i * sizeof(SectionEntry), sizeof(e));
+        if (e.offset > static_cast<u64>(file->size) || e.size > static_cast<u64>(file->size) - e.offset)
+            return nullptr;
+        reader->sections[e.tag] = std::string_view(reinterpret_cast<const char*>(file->data) + e.offset, e.size);
+    }
+    reader->file = std::move(file);
+    return reader;
+}
+
+std::optional<std::string_view> SectionReader::get(const u32 tag) const
+{
+    const auto it = sections.find(tag);
+    if (it == sections.end())
+        return std::nullopt;
+    return it->second;
+}
+
+std::string cache_path(const Context& ctx, const u64 key, const std::string& suffix)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(ctx.arg.cache_dir, ec);
+    return ctx.arg.cache_dir + "/" + hex_string(key) + suffix;
+}
+
+static Counter num_pixel_cache_hits("pixel_cache_hits");
+
+// Which content a path had when it was last seen, so that an unchanged file
+// is found in the pixel cache without hashing it.
+struct PixelRef {
+    i64 size;
+    i64 mtime;
+    u64 key;
+};
+
+struct PixelLayout {
+    i32 rows;
+    i32 cols;
+    i32 color_type;
+    i32 gray_type;
+};
+
+static std::string pixel_cache_file(const Context& ctx, const u64 key, const std::string& suffix)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(ctx.arg.pixel_cache_dir, ec);
+    return ctx.arg.pixel_cache_dir + "/" + hex_string(key) + suffix;
+}
+
+static u64 pixel_key(Context& ctx, const MappedFile<Context>& file)
+{
+    std::error_code ec;
+    const std::string path = std::filesystem::absolute(file.name, ec).string();
+    const u64 ref_key = hash_bytes(path.data(), path.size());
+    const std::string ref_file = pixel_cache_file(ctx, ref_key, ".ref");
+
+    PixelRef ref {};
+    if (const auto reader = SectionReader::open(ctx, ref_file, ref_key)) {
+        if (reader->get_value(section_tag("PREF"), ref) && ref.size == file.size && ref.mtime == file.mtime)
+            return ref.key;
+    }
+
+    ref = { file.size, file.mtime, hash_bytes(file.data, file.size) };
+    SectionWriter writer;
+    writer.add_value(section_tag("PREF"), ref);
+    writer.write(ref_file, ref_key);
+    return ref.key;
+}
+
+// The pixels are used in place; the mapping is read-only, which is fine as
+// long as nobody draws into these two images.
+bool read_pixels(const SectionReader& reader, cv::Mat& color, cv::Mat& gray)
+{
+    PixelLayout layout {};
+    if (!reader.get_value(section_tag("PXLY"), layout))
+        return false;
+
+    const auto color_pixels = reader.get(section_tag("PXCL"));
+    const auto gray_pixels = reader.get(section_tag("PXGR"));
+    if (layout.rows <= 0 || layout.cols <= 0 || !color_pixels || !gray_pixels
+        || color_pixels->size() != static_cast<std::size_t>(layout.rows) * layout.cols * CV_ELEM_SIZE(layout.color_type)
+        || gray_pixels->size() != static_cast<std::size_t>(layout.rows) * layout.cols * CV_ELEM_SIZE(layout.gray_type))
+        return false;
+
+    color = cv::Mat(layout.rows, layout.cols, layout.color_type, const_cast<char*>(color_pixels->data()));
+    gray = cv::Mat(layout.rows, layout.cols, layout.gray_type, const_cast<char*>(gray_pixels->data()));
+    return true;
+}
+
+// `color` and `gray` must be continuous and outlive the writer
+void write_pixels(SectionWriter& writer, const cv::Mat& color, const cv::Mat& gray)
+{
+    writer.add_value(section_tag("PXLY"), PixelLayout { color.rows, color.cols, color.type(), gray.type() });
+    writer.add(section_tag("PXCL"), color.data, color.total() * color.elemSize());
+    writer.add(section_tag("PXGR"), gray.data, gray.total() * gray.elemSize());
+}
+
+bool read_pixel_cache(Context& ctx, const MappedFile<Context>& file, cv::Mat& color, cv::Mat& gray, std::unique_ptr<SectionReader>& mapping)
+{
+    const u64 key = pixel_key(ctx, file);
+    const std::string path = pixel_cache_file(ctx, key, ".pix");
+    std::unique_ptr<SectionReader> reader = SectionReader::open(ctx, path, key);
+    if (!reader || !read_pixels(*reader, color, gray))
+        return false;
+    mapping = std::move(reader);
+
+    // the modification time orders the entries for eviction
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    num_pixel_cache_hits++;
+    return true;
+}
+
+// Removes the least recently used entries until the cache fits into
+// -pixel_cache_size. Only *.pix files are entries: the .ref files go with
+// the entry they point to, and *.tmp.* files are still being written by
+// another run.
+static void evict_pixel_cache(Context& ctx)
+{
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type used;
+        u64 size;
+    };
+    std::vector<Entry> entries;
+    u64 total = 0;
+
+    std::error_code ec;
+    for (const auto& e : std::filesystem::directory_iterator(ctx.arg.pixel_cache_dir, ec)) {
+        std::error_code ec2;
+        if (!e.is_regular_file(ec2) || e.path().extension() != ".pix")
+            continue;
+        entries.push_back({ e.path(), e.last_write_time(ec2), e.file_size(ec2) });
+        total += entries.back().size;
+    }
+    if (total <= static_cast<u64>(ctx.arg.pixel_cache_size))
+        return;
+
+    std::ranges::sort(entries, [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    std::set<std::string> evicted;
+    for (const Entry& e : entries) {
+        if (total <= static_cast<u64>(ctx.arg.pixel_cache_size))
+            break;
+        // a concurrent run may have removed it already
+        if (std::filesystem::remove(e.path, ec)) {
+            total -= e.size;
+            evicted.insert(e.path.stem().string());
+        }
+    }
+    if (evicted.empty())
+        return;
+
+    for (const auto& e : std::filesystem::directory_iterator(ctx.arg.pixel_cache_dir, ec)) {
+        if (e.path().extension() != ".ref")
+            continue;
+        const std::string stem = e.path().stem().string();
+        u64 ref_key = 0;
+        if (std::from_chars(stem.data(), stem.data() + stem.size(), ref_key, 16).ptr != stem.data() + stem.size())
+            continue;
+
+        PixelRef ref {};
+        const std::unique_ptr<SectionReader> reader = SectionReader::open(ctx, e.path().string(), ref_key);
+        if (reader && reader->get_value(section_tag("PREF"), ref) && evicted.contains(hex_string(ref.key)))
+            std::filesystem::remove(e.path(), ec);
+    }
+}
+
+void write_pixel_cache(Context& ctx, const MappedFile<Context>& file, const cv::Mat& color, const cv::Mat& gray)
+{
+    if (color.empty() || !color.isContinuous() || !gray.isContinuous())
+        return;
+
+    const u64 key = pixel_key(ctx, file);
+    SectionWriter writer;
+    write_pixels(writer, color, gray);
+    if (writer.write(pixel_cache_file(ctx, key, ".pix"), key))
+        evict_pixel_cache(ctx);
+}
+
+} // namespace gazosan
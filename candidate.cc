@@ -0,0 +1,110 @@
+#include "gazosan.h"
+
+#include <bit>
+#include <cmath>
+
+namespace gazosan {
+
+static Counter num_candidate_pairs("candidate_pairs");
+static Counter num_pruned_pairs("pruned_pairs");
+static Counter num_hash_pruned_pairs("hash_pruned_pairs");
+
+static double log_tolerance(const double tolerance)
+{
+    return tolerance > 1.0 ? std::log(tolerance) : 0.0;
+}
+
+CandidateIndex::CandidateIndex(const Context& ctx, const std::vector<ImageSegment>& segments)
+    : segments(segments)
+    , log_size_tolerance(log_tolerance(ctx.arg.size_tolerance))
+    , log_aspect_tolerance(log_tolerance(ctx.arg.aspect_tolerance))
+    , position_tolerance(std::max(ctx.arg.position_tolerance, 0))
+    , hash_tolerance(ctx.arg.hash_tolerance)
+{
+    for (i32 i = 0; i < static_cast<i32>(segments.size()); i++)
+        buckets[hash_key(key_of(segments[i].area))].push_back(i);
+}
+
+// Every dimension is quantized with the tolerance as bucket width, so two
+// plausible rectangles never lie more than one bucket apart.
+CandidateIndex::Key CandidateIndex::key_of(const cv::Rect& area) const
+{
+    Key key {};
+    const double w = std::max(area.width, 1);
+    const double h = std::max(area.height, 1);
+    if (log_size_tolerance > 0)
+        key.size = static_cast<i32>(std::floor(0.5 * std::log(w * h) / log_size_tolerance));
+    if (log_aspect_tolerance > 0)
+        key.aspect = static_cast<i32>(std::floor(std::log(w / h) / log_aspect_tolerance));
+    if (position_tolerance > 0) {
+        key.x = (area.x + area.width / 2) / position_tolerance;
+        key.y = (area.y + area.height / 2) / position_tolerance;
+    }
+    return key;
+}
+
+bool CandidateIndex::is_plausible(const cv::Rect& a, const cv::Rect& b) const
+{
+    const double aw = std::max(a.width, 1), ah = std::max(a.height, 1);
+    const double bw = std::max(b.width, 1), bh = std::max(b.height, 1);
+
+    if (log_size_tolerance > 0 && std::abs(0.5 * std::log((aw * ah) / (bw * bh))) > log_size_tolerance)
+        return false;
+    if (log_aspect_tolerance > 0 && std::abs(std::log((aw / ah) / (bw / bh))) > log_aspect_tolerance)
+        return false;
+    if (position_tolerance > 0) {
+        if (std::abs((a.x + a.width / 2) - (b.x + b.width / 2)) > position_tolerance)
+            return false;
+        if (std::abs((a.y + a.height / 2) - (b.y + b.height / 2)) > position_tolerance)
+            return false;
+    }
+    return true;
+}
+
+u64 CandidateIndex::hash_key(const Key& key)
+{
+    return (static_cast<u64>(static_cast<u16>(key.size)) << 48)
+        | (static_cast<u64>(static_cast<u16>(key.aspect)) << 32)
+        | (static_cast<u64>(static_cast<u16>(key.x)) << 16)
+        | static_cast<u64>(static_cast<u16>(key.y));
+}
+
+std::vector<i32> CandidateIndex::find(const ImageSegment& query) const
+{
+    const Key key = key_of(query.area);
+    const i32 ds = log_size_tolerance > 0 ? 1 : 0;
+    const i32 da = log_aspect_tolerance > 0 ? 1 : 0;
+    const i32 dp = position_tolerance > 0 ? 1 : 0;
+
+    std::vector<i32> result;
+    i64 hash_pruned = 0;
+    for (i32 s = key.size - ds; s <= key.size + ds; s++) {
+        for (i32 a = key.aspect - da; a <= key.aspect + da; a++) {
+            for (i32 x = key.x - dp; x <= key.x + dp; x++) {
+                for (i32 y = key.y - dp; y <= key.y + dp; y++) {
+                    const auto it = buckets.find(hash_key({ s, a, x, y }));
+                    if (it == buckets.end())
+                        continue;
+                    for (const i32 idx : it->second) {
+                        if (!is_plausible(query.area, segments[idx].area))
+                            continue;
+                        // rejects the obvious non-matches before any descriptor work
+                        if (std::popcount(query.hash ^ segments[idx].hash) > hash_tolerance) {
+                            hash_pruned++;
+                            continue;
+                        }
+                        result.push_back(idx);
+                    }
+                }
+            }
+        }
+    }
+    std::ranges::sort(result);
+
+    num_candidate_pairs += static_cast<i64>(result.size());
+    num_pruned_pairs += static_cast<i64>(segments.size() - result.size()) - hash_pruned;
+    num_hash_pruned_pairs += hash_pruned;
+    return result;
+}
+
+} // namespace gazosan
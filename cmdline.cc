@@ -4,17 +4,62 @@
 
 #include "gazosan.h"
 
+#include <glob.h>
+
 namespace gazosan {
 
+// The files matching `pattern`, for shells which do not expand it or when it
+// is quoted to get past the argument limit. A path without wildcards is
+// returned as is.
+static std::vector<std::string> expand_glob(Context& ctx, const std::string& pattern)
+{
+    if (pattern.find_first_of("*?[") == std::string::npos)
+        return { pattern };
+
+    glob_t g {};
+    const int rc = glob(pattern.c_str(), 0, nullptr, &g);
+    if (rc != 0) {
+        globfree(&g);
+        Fatal(ctx) << "-new: no file matches " << pattern;
+    }
+    std::vector<std::string> paths(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+    globfree(&g);
+    return paths;
+}
+
 static constexpr char help_msg[] = R"(
 Options:
-  -new <FILE>                 new image file path
+  -new <FILE>                 new image file path, or a glob pattern. May be repeated
+                              to compare the old image against every one of them
   -old <FILE>                 old image file path
+  -old_index <FILE>           index of the old image, in place of -old
+  -old_dir <DIR>, -new_dir <DIR>
+                              compare the images of two trees with the same relative paths
   -o, --output <NAME>         output prefix name (default: image_difference)
+  -output_format <png|ppm|qoi>
+                              format of the output images (default: png)
   -create_change_image        create changed image
   -threshold <NUMBER>         binary threshold
   -cross_check                cross check descriptor matching
-  -thread_count <NUMBER>      Use given number of threads
+  -features <akaze|orb|brisk|phash>
+                              feature backend (default: akaze)
+  -max_keypoints <NUMBER>     keep the strongest keypoints per segment (default: 1000, 0 for unlimited)
+  -matcher <l2|hamming|flann> descriptor matcher (default: hamming)
+  -size_tolerance <RATIO>     max size ratio of a candidate pair (default: 4, 0 to disable)
+  -aspect_tolerance <RATIO>   max aspect ratio difference of a candidate pair (default: 4, 0 to disable)
+  -position_tolerance <PX>    max center distance of a candidate pair (default: 0, disabled)
+  -hash_tolerance <BITS>      max hash distance of a candidate pair (default: 16, 64 to disable)
+  -cache_dir <DIR>            cache the segments and descriptors of old images in DIR
+  -pixel_cache_dir <DIR>      cache decoded pixels of old images in DIR
+  -pixel_cache_size <MB>      evict least recently used pixels beyond this size (default: 1024)
+  -thread_count <NUMBER>      Use given number of threads, OpenCV included
+  -descriptor_tile_size <PX|auto>
+                              tile segments larger than this for the feature backends (default: 512)
+  -memory_budget <MB>         memory for concurrent descriptor work, sizes the tiles of
+                              -descriptor_tile_size auto (default: half of the available memory)
+  -side_arenas                run the old and the new image in separate task arenas
+  -max_in_flight <NUMBER>     pairs in memory at once when comparing many images (default: threads + 2)
+  -loader <mmap|io_uring>     how a batch reads its files (default: io_uring if built with it)
   -perf                       Print performance statistics
 
 
@@ -26,7 +71,15 @@ void parse_args(Context& ctx)
     Timer t(ctx, "parse args");
     std::vector<std::string_view>& args = ctx.cmdline_args;
 
+    bool matcher_given = false;
+
+    // `gazosan index` writes the index of -old to -o
     int i = 1;
+    if (args.size() > 1 && args[1] == "index") {
+        ctx.arg.build_index = true;
+        i = 2;
+    }
+
     while (i < args.size()) {
         std::string_view arg;
 
@@ -51,25 +104,107 @@ void parse_args(Context& ctx)
         if (read_flag("-h") || read_flag("--help")) {
             std::cout << "Usage: " << ctx.cmdline_args[0]
                       << " [options]\n"
+                      << "       " << ctx.cmdline_args[0] << " index -old <FILE> -o <INDEX> [options]\n"
                       << help_msg;
             exit(0);
         }
         if (read_arg("-color-diagnostics") || read_arg("--color-diagnostics")) {
             ctx.arg.color_diagnostics = true;
         } else if (read_arg("-new")) {
-            ctx.arg.new_file = arg;
+            std::ranges::copy(expand_glob(ctx, std::string(arg)), std::back_inserter(ctx.arg.new_files));
         } else if (read_arg("-old")) {
             ctx.arg.old_file = arg;
+        } else if (read_arg("-old_dir")) {
+            ctx.arg.old_dir = arg;
+        } else if (read_arg("-new_dir")) {
+            ctx.arg.new_dir = arg;
+        } else if (read_arg("-old_index")) {
+            ctx.arg.old_index = arg;
         } else if (read_arg("-threshold")) {
             ctx.arg.bin_threshold = std::stoi(std::string(arg));
         } else if (read_arg("-o") || read_arg("--output")) {
             ctx.arg.output_name = arg;
+        } else if (read_arg("-output_format")) {
+            if (arg == "png")
+                ctx.arg.output_format = ImageFormat::PNG;
+            else if (arg == "ppm")
+                ctx.arg.output_format = ImageFormat::PPM;
+            else if (arg == "qoi")
+                ctx.arg.output_format = ImageFormat::QOI;
+            else
+                Fatal(ctx) << "unknown -output_format: " << arg;
         } else if (read_flag("-create_change_image")) {
             ctx.arg.create_change_image = true;
         } else if (read_flag("-cross_check")) {
             ctx.arg.cross_check = true;
+        } else if (read_arg("-features")) {
+            if (arg == "akaze")
+                ctx.arg.features = FeatureType::AKAZE;
+            else if (arg == "orb")
+                ctx.arg.features = FeatureType::ORB;
+            else if (arg == "brisk")
+                ctx.arg.features = FeatureType::BRISK;
+            else if (arg == "phash")
+                ctx.arg.features = FeatureType::PHASH;
+            else
+                Fatal(ctx) << "unknown -features: " << arg;
+        } else if (read_arg("-max_keypoints")) {
+            ctx.arg.max_keypoints = std::stoi(std::string(arg));
+        } else if (read_arg("-matcher")) {
+            matcher_given = true;
+            if (arg == "l2")
+                ctx.arg.matcher = MatcherType::L2;
+            else if (arg == "hamming")
+                ctx.arg.matcher = MatcherType::HAMMING;
+            else if (arg == "flann")
+                ctx.arg.matcher = MatcherType::FLANN;
+            else
+                Fatal(ctx) << "unknown -matcher: " << arg;
+        } else if (read_arg("-size_tolerance")) {
+            ctx.arg.size_tolerance = std::stod(std::string(arg));
+        } else if (read_arg("-aspect_tolerance")) {
+            ctx.arg.aspect_tolerance = std::stod(std::string(arg));
+        } else if (read_arg("-position_tolerance")) {
+            ctx.arg.position_tolerance = std::stoi(std::string(arg));
+        } else if (read_arg("-hash_tolerance")) {
+            ctx.arg.hash_tolerance = std::stoi(std::string(arg));
+        } else if (read_arg("-cache_dir")) {
+            ctx.arg.cache_dir = arg;
+        } else if (read_arg("-pixel_cache_dir")) {
+            ctx.arg.pixel_cache_dir = arg;
+        } else if (read_arg("-pixel_cache_size")) {
+            ctx.arg.pixel_cache_size = std::stoll(std::string(arg)) * 1024 * 1024;
         } else if (read_arg("-thread_count")) {
             ctx.arg.thread_count = std::stoi(std::string(arg));
+        } else if (read_arg("-descriptor_tile_size")) {
+            if (arg == "auto") {
+                ctx.arg.descriptor_tile_size = 0;
+            } else {
+                ctx.arg.descriptor_tile_size = std::stoi(std::string(arg));
+                if (ctx.arg.descriptor_tile_size < 128)
+                    Fatal(ctx) << "-descriptor_tile_size must be at least 128: " << arg;
+            }
+        } else if (read_arg("-memory_budget")) {
+            ctx.arg.memory_budget = std::stoll(std::string(arg)) * 1024 * 1024;
+            if (ctx.arg.memory_budget <= 0)
+                Fatal(ctx) << "-memory_budget must be positive: " << arg;
+        } else if (read_flag("-side_arenas")) {
+            ctx.arg.side_arenas = true;
+        } else if (read_arg("-loader")) {
+            if (arg == "mmap")
+                ctx.arg.io_uring = false;
+            else if (arg == "io_uring")
+                ctx.arg.io_uring = true;
+            else
+                Fatal(ctx) << "unknown -loader: " << arg;
+#ifndef ENABLE_IO_URING
+            if (ctx.arg.io_uring)
+                Fatal(ctx) << "-loader io_uring: not built with ENABLE_IO_URING";
+#endif
+        } else if (read_arg("-max_in_flight")) {
+            ctx.arg.max_in_flight = std::stoi(std::string(arg));
+            if (ctx.arg.max_in_flight <= 0)
+                Fatal(ctx) << "-max_in_flight must be positive: " << arg;
         } else if (read_flag("-perf")) {
             ctx.arg.perf = true;
         } else {
@@ -78,12 +213,39 @@ void parse_args(Context& ctx)
             i++;
         }
     }
-    if (ctx.arg.new_file.empty())
-        Fatal(ctx) << "\"-new\" option is required";
-    if (ctx.arg.old_file.empty())
-        Fatal(ctx) << "\"-old\" option is required";
+    if (ctx.arg.build_index) {
+        if (ctx.arg.old_file.empty())
+            Fatal(ctx) << "index: \"-old\" option is required";
+        if (ctx.arg.output_name.empty())
+            Fatal(ctx) << "index: \"-o\" option is required";
+        if (!ctx.arg.new_files.empty() || !ctx.arg.old_index.empty() || !ctx.arg.old_dir.empty() || !ctx.arg.new_dir.empty())
+            Fatal(ctx) << "index: only \"-old\" is allowed as input";
+    } else if (!ctx.arg.old_dir.empty() || !ctx.arg.new_dir.empty()) {
+        if (ctx.arg.old_dir.empty() || ctx.arg.new_dir.empty())
+            Fatal(ctx) << "\"-old_dir\" and \"-new_dir\" go together";
+        if (!ctx.arg.new_files.empty() || !ctx.arg.old_file.empty() || !ctx.arg.old_index.empty())
+            Fatal(ctx) << "\"-old_dir\" and \"-new_dir\" replace the other inputs";
+    } else {
+        if (ctx.arg.new_files.empty())
+            Fatal(ctx) << "\"-new\" option is required";
+        if (ctx.arg.new_files.size() == 1)
+            ctx.arg.new_file = ctx.arg.new_files[0];
+        if (ctx.arg.old_file.empty() == ctx.arg.old_index.empty())
+            Fatal(ctx) << "either \"-old\" or \"-old_index\" is required";
+    }
+    if (!matcher_given)
+        ctx.arg.matcher = default_matcher(ctx.arg.features);
     if (ctx.arg.thread_count == 0)
-        ctx.arg.thread_count = static_cast<i64>(get_default_thread_count());
+        ctx.arg.thread_count = static_cast<i64>(get_default_thread_count(ctx.limits));
+    // a pair for every thread, and two more being read
+    if (ctx.arg.max_in_flight == 0)
+        ctx.arg.max_in_flight = ctx.arg.thread_count + 2;
+    if (ctx.arg.memory_budget == 0)
+        ctx.arg.memory_budget = get_default_memory_budget(ctx.limits);
+    if (ctx.arg.size_tolerance != 0 && ctx.arg.size_tolerance < 1)
+        Fatal(ctx) << "-size_tolerance: must be 0 or at least 1";
+    if (ctx.arg.aspect_tolerance != 0 && ctx.arg.aspect_tolerance < 1)
+        Fatal(ctx) << "-aspect_tolerance: must be 0 or at least 1";
     if (ctx.arg.bin_threshold == 0)
         ctx.arg.bin_threshold = 200;
     if (ctx.arg.output_name.empty()) {
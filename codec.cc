@@ -0,0 +1,257 @@
+#include "gazosan.h"
+
+namespace gazosan {
+
+static Counter num_native_decodes("native_decodes");
+
+// Binary PGM (P5) and PPM (P6) with 8-bit samples. Others, e.g. 16-bit
+// ones, are left to OpenCV.
+static bool read_pnm(const MappedFile<Context>& file, cv::Mat& color, cv::Mat& gray)
+{
+    const u8* p = file.data;
+    const u8* const end = file.data + file.size;
+    if (file.size < 2 || p[0] != 'P' || (p[1] != '5' && p[1] != '6'))
+        return false;
+    const int channels = p[1] == '5' ? 1 : 3;
+    p += 2;
+
+    // width, height and maxval, separated by whitespace and comments
+    i64 values[3] = {};
+    for (i64& value : values) {
+        for (;;) {
+            while (p < end && std::isspace(*p))
+                p++;
+            if (p < end && *p == '#') {
+                while (p < end && *p != '\n')
+                    p++;
+                continue;
+            }
+            break;
+        }
+        if (p == end || !std::isdigit(*p))
+            return false;
+        for (; p < end && std::isdigit(*p) && value < (1 << 24); p++)
+            value = value * 10 + (*p - '0');
+    }
+    // a single whitespace character ends the header
+    if (p == end || !std::isspace(*p++))
+        return false;
+
+    const i64 width = values[0];
+    const i64 height = values[1];
+    if (width <= 0 || height <= 0 || values[2] != 255 || end - p < width * height * channels)
+        return false;
+
+    // the samples are used in place
+    const cv::Mat samples(static_cast<int>(height), static_cast<int>(width), CV_8UC(channels), const_cast<u8*>(p));
+    if (channels == 1) {
+        gray = samples;
+        cv::cvtColor(gray, color, cv::COLOR_GRAY2BGR);
+    } else {
+        cv::cvtColor(samples, color, cv::COLOR_RGB2BGR);
+        cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+    }
+    return true;
+}
+
+// QOI, the "Quite OK Image Format" (https://qoiformat.org/qoi-specification.pdf)
+static constexpr u8 qoi_op_index = 0x00;
+static constexpr u8 qoi_op_diff = 0x40;
+static constexpr u8 qoi_op_luma = 0x80;
+static constexpr u8 qoi_op_run = 0xc0;
+static constexpr u8 qoi_op_rgb = 0xfe;
+static constexpr u8 qoi_op_rgba = 0xff;
+static constexpr u8 qoi_mask = 0xc0;
+static constexpr i64 qoi_header_size = 14;
+static constexpr u8 qoi_padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+struct QoiPixel {
+    u8 r = 0;
+    u8 g = 0;
+    u8 b = 0;
+    u8 a = 0;
+
+    bool operator==(const QoiPixel&) const = default;
+
+    [[nodiscard]] i32 hash() const
+    {
+        return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+    }
+};
+
+static u32 read_be32(const u8* p)
+{
+    return static_cast<u32>(p[0]) << 24 | static_cast<u32>(p[1]) << 16 | static_cast<u32>(p[2]) << 8 | p[3];
+}
+
+static bool read_qoi(const MappedFile<Context>& file, cv::Mat& color, cv::Mat& gray)
+{
+    const u8* p = file.data;
+    if (file.size < qoi_header_size + static_cast<i64>(sizeof(qoi_padding)) || std::memcmp(p, "qoif", 4) != 0)
+        return false;
+    const u32 width = read_be32(p + 4);
+    const u32 height = read_be32(p + 8);
+    const u8 channels = p[12];
+    // the limit of the reference implementation
+    if (width == 0 || height == 0 || (channels != 3 && channels != 4) || height >= 400000000 / width)
+        return false;
+
+    color.create(static_cast<int>(height), static_cast<int>(width), CV_8UC3);
+    // every chunk is at least one byte, and the padding follows the last one
+    const u8* const chunks_end = file.data + file.size - sizeof(qoi_padding);
+    p += qoi_header_size;
+
+    QoiPixel index[64] = {};
+    QoiPixel px { 0, 0, 0, 255 };
+    i32 run = 0;
+    for (int y = 0; y < color.rows; y++) {
+        auto* row = color.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < color.cols; x++) {
+            if (run > 0) {
+                run--;
+            } else if (p < chunks_end) {
+                const u8 b1 = *p++;
+                if (b1 == qoi_op_rgb) {
+                    px.r = p[0];
+                    px.g = p[1];
+                    px.b = p[2];
+                    p += 3;
+                } else if (b1 == qoi_op_rgba) {
+                    px = { p[0], p[1], p[2], p[3] };
+                    p += 4;
+                } else if ((b1 & qoi_mask) == qoi_op_index) {
+                    px = index[b1];
+                } else if ((b1 & qoi_mask) == qoi_op_diff) {
+                    px.r += ((b1 >> 4) & 3) - 2;
+                    px.g += ((b1 >> 2) & 3) - 2;
+                    px.b += (b1 & 3) - 2;
+                } else if ((b1 & qoi_mask) == qoi_op_luma) {
+                    const u8 b2 = *p++;
+                    const i32 vg = (b1 & 0x3f) - 32;
+                    px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                    px.g += vg;
+                    px.b += vg - 8 + (b2 & 0x0f);
+                } else {
+                    run = b1 & 0x3f;
+                }
+                index[px.hash()] = px;
+            }
+            // alpha is dropped, as by cv::IMREAD_COLOR
+            row[x] = cv::Vec3b(px.b, px.g, px.r);
+        }
+    }
+    cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+    return true;
+}
+
+static std::vector<u8> encode_qoi(const cv::Mat& image)
+{
+    std::vector<u8> out;
+    out.reserve(qoi_header_size + image.total() * 2 + sizeof(qoi_padding));
+    auto put32 = [&](const u32 v) {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            out.push_back(static_cast<u8>(v >> shift));
+    };
+    out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+    put32(image.cols);
+    put32(image.rows);
+    out.push_back(3); // channels
+    out.push_back(0); // sRGB with linear alpha
+
+    QoiPixel index[64] = {};
+    QoiPixel prev { 0, 0, 0, 255 };
+    i32 run = 0;
+    const i64 last = static_cast<i64>(image.total()) - 1;
+    for (int y = 0; y < image.rows; y++) {
+        const auto* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < image.cols; x++) {
+            const QoiPixel px { row[x][2], row[x][1], row[x][0], 255 };
+            const i64 pos = static_cast<i64>(y) * image.cols + x;
+
+            if (px == prev) {
+                if (++run == 62 || pos == last) {
+                    out.push_back(qoi_op_run | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                out.push_back(qoi_op_run | (run - 1));
+                run = 0;
+            }
+
+            const i32 h = px.hash();
+            if (index[h] == px) {
+                out.push_back(qoi_op_index | h);
+            } else {
+                index[h] = px;
+                const i32 vr = static_cast<i8>(px.r - prev.r);
+                const i32 vg = static_cast<i8>(px.g - prev.g);
+                const i32 vb = static_cast<i8>(px.b - prev.b);
+                const i32 vg_r = vr - vg;
+                const i32 vg_b = vb - vg;
+                if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+                    out.push_back(qoi_op_diff | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                } else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 && vg_b >= -8 && vg_b <= 7) {
+                    out.push_back(qoi_op_luma | (vg + 32));
+                    out.push_back((vg_r + 8) << 4 | (vg_b + 8));
+                } else {
+                    out.insert(out.end(), { qoi_op_rgb, px.r, px.g, px.b });
+                }
+            }
+            prev = px;
+        }
+    }
+    out.insert(out.end(), std::begin(qoi_padding), std::end(qoi_padding));
+    return out;
+}
+
+// Formats decoded without cv::imdecode. PGM samples are used in place.
+bool read_native_image(const MappedFile<Context>& file, cv::Mat& color, cv::Mat& gray)
+{
+    if (!read_pnm(file, color, gray) && !read_qoi(file, color, gray))
+        return false;
+    num_native_decodes++;
+    return true;
+}
+
+std::string output_path(const Context& ctx, const std::string& suffix)
+{
+    switch (ctx.arg.output_format) {
+    case ImageFormat::PPM:
+        return ctx.arg.output_name + suffix + ".ppm";
+    case ImageFormat::QOI:
+        return ctx.arg.output_name + suffix + ".qoi";
+    default:
+        return ctx.arg.output_name + suffix + ".png";
+    }
+}
+
+// Writes a BGR image in -output_format. A file that could not be written
+// completely is removed, so that it is never taken for a result.
+bool write_image(const Context& ctx, const std::string& path, const cv::Mat& image)
+{
+    // The file may be a hard link to the output of another pair, made by
+    // reuse_result in an earlier run; writing it in place would change that
+    // one too. This holds with or without -cache_dir.
+    unlink(path.c_str());
+    bool ok = false;
+    if (ctx.arg.output_format != ImageFormat::QOI) {
+        // PPM is uncompressed in OpenCV as well
+        try {
+            ok = cv::imwrite(path, image);
+        } catch (const cv::Exception&) {
+        }
+    } else if (FILE* out = fopen(path.c_str(), "wb")) {
+        const std::vector<u8> data = encode_qoi(image);
+        ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+        // fclose reports the errors of the buffered writes
+        ok = fclose(out) == 0 && ok;
+    }
+
+    if (!ok)
+        unlink(path.c_str());
+    return ok;
+}
+
+} // namespace gazosan
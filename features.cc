@@ -0,0 +1,205 @@
+#include "gazosan.h"
+
+#include <array>
+#include <functional>
+
+namespace gazosan {
+
+static Counter num_keypoints("keypoints");
+static Counter num_dropped_keypoints("dropped_keypoints");
+
+// Wraps any OpenCV keypoint detector and descriptor extractor. One detector
+// is configured per size class, so that small segments do not build octaves
+// which cannot hold any feature.
+class Feature2DBackend : public FeatureBackend {
+public:
+    static constexpr int max_octaves = 4;
+
+    // `create` returns a detector working on the given number of octaves
+    Feature2DBackend(const std::function<cv::Ptr<cv::Feature2D>(int)>& create, const i32 max_keypoints)
+        : max_keypoints(max_keypoints)
+    {
+        for (int i = 0; i < max_octaves; i++)
+            algorithms[i] = create(i + 1);
+    }
+
+    cv::Mat compute(const cv::Mat& img) override
+    {
+        return extract(img, cv::Rect(0, 0, img.cols, img.rows), max_keypoints);
+    }
+
+    [[nodiscard]] bool is_local() const override
+    {
+        return true;
+    }
+
+    cv::Mat compute_within(const cv::Mat& img, const cv::Rect& core, const double share) override
+    {
+        i32 cap = max_keypoints;
+        if (cap > 0)
+            cap = std::max(1, static_cast<i32>(cap * share));
+        return extract(img, core, cap);
+    }
+
+private:
+    // Each octave halves the image; stop while the smallest one still has
+    // room for a descriptor pattern.
+    static int octaves_for(const cv::Mat& img)
+    {
+        constexpr int min_octave_side = 32;
+        const int side = std::min(img.cols, img.rows);
+        int octaves = 1;
+        while (octaves < max_octaves && (side >> octaves) >= min_octave_side)
+            octaves++;
+        return octaves;
+    }
+
+    cv::Mat extract(const cv::Mat& img, const cv::Rect& core, const i32 cap)
+    {
+        cv::Feature2D& algorithm = *algorithms[octaves_for(img) - 1];
+
+        std::vector<cv::KeyPoint> keypoint;
+        cv::Mat descriptor;
+        algorithm.detect(img, keypoint);
+        std::erase_if(keypoint, [&](const cv::KeyPoint& kp) {
+            return kp.pt.x < core.x || kp.pt.y < core.y || kp.pt.x >= core.x + core.width || kp.pt.y >= core.y + core.height;
+        });
+        if (keypoint.empty())
+            return {};
+
+        // keep the strongest responses only, this bounds the matching cost
+        num_keypoints += static_cast<i64>(keypoint.size());
+        if (cap > 0 && keypoint.size() > static_cast<std::size_t>(cap)) {
+            const std::size_t before = keypoint.size();
+            cv::KeyPointsFilter::retainBest(keypoint, cap);
+            num_dropped_keypoints += static_cast<i64>(before - keypoint.size());
+        }
+
+        algorithm.compute(img, keypoint, descriptor);
+        return descriptor;
+    }
+
+    std::array<cv::Ptr<cv::Feature2D>, max_octaves> algorithms;
+    i32 max_keypoints;
+};
+
+// A single 64 bit DCT perceptual hash of the whole segment. It has no
+// keypoints, so a segment matches if the hashes are (almost) equal.
+class PHashBackend : public FeatureBackend {
+public:
+    cv::Mat compute(const cv::Mat& img) override
+    {
+        cv::Mat thumbnail, spectrum;
+        cv::resize(img, thumbnail, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+        thumbnail.convertTo(thumbnail, CV_32F);
+        cv::dct(thumbnail, spectrum);
+
+        // lowest 8x8 frequencies without the DC term, compared to their median
+        float coefficients[64];
+        for (int y = 0; y < 8; y++)
+            for (int x = 0; x < 8; x++)
+                coefficients[y * 8 + x] = spectrum.at<float>(y, x);
+
+        float sorted[63];
+        std::copy(coefficients + 1, coefficients + 64, sorted);
+        std::nth_element(sorted, sorted + 31, sorted + 63);
+        const float median = sorted[31];
+
+        cv::Mat descriptor = cv::Mat::zeros(1, 8, CV_8U);
+        for (int i = 1; i < 64; i++) {
+            if (coefficients[i] > median)
+                descriptor.at<u8>(0, i / 8) |= static_cast<u8>(1 << (i % 8));
+        }
+        return descriptor;
+    }
+};
+
+// A fast non-cryptographic hash of the pixels of `img` and its size.
+u64 content_hash(const cv::Mat& img)
+{
+    constexpr u64 prime = 0x9e3779b97f4a7c15ULL;
+    auto mix = [](u64 h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    };
+
+    u64 h = mix((static_cast<u64>(img.cols) << 32) ^ static_cast<u64>(img.rows) ^ static_cast<u64>(img.type()) << 56);
+    const std::size_t row_bytes = img.cols * img.elemSize();
+    for (int y = 0; y < img.rows; y++) {
+        const u8* p = img.ptr<u8>(y);
+        std::size_t i = 0;
+        for (; i + 8 <= row_bytes; i += 8) {
+            u64 word;
+            std::memcpy(&word, p + i, 8);
+            h = (h ^ mix(word)) * prime;
+        }
+        u64 tail = 0;
+        std::memcpy(&tail, p + i, row_bytes - i);
+        h = (h ^ mix(tail ^ y)) * prime;
+    }
+    return mix(h);
+}
+
+// dHash: each bit tells whether a pixel of a 9x8 thumbnail is darker than
+// its right neighbour. Cheap enough to compute for every segment.
+u64 difference_hash(const cv::Mat& img)
+{
+    if (img.empty())
+        return 0;
+
+    cv::Mat thumbnail;
+    cv::resize(img, thumbnail, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+
+    u64 hash = 0;
+    for (int y = 0; y < 8; y++) {
+        const u8* row = thumbnail.ptr<u8>(y);
+        for (int x = 0; x < 8; x++)
+            hash = (hash << 1) | (row[x] < row[x + 1] ? 1 : 0);
+    }
+    return hash;
+}
+
+std::unique_ptr<FeatureBackend> create_feature_backend(const FeatureType type, const i32 max_keypoints)
+{
+    switch (type) {
+    case FeatureType::AKAZE:
+        return std::make_unique<Feature2DBackend>([](const int octaves) {
+            return cv::AKAZE::create(cv::AKAZE::DESCRIPTOR_MLDB, 0, 3, 0.001f, octaves);
+        }, max_keypoints);
+    case FeatureType::ORB:
+        // UI segments are small, so use a smaller patch than the default 31px.
+        // with a scale factor of 1.2, about four levels make up an octave.
+        return std::make_unique<Feature2DBackend>([](const int octaves) {
+            return cv::ORB::create(500, 1.2f, octaves * 4, 15, 0, 2, cv::ORB::HARRIS_SCORE, 15);
+        }, max_keypoints);
+    case FeatureType::BRISK:
+        return std::make_unique<Feature2DBackend>([](const int octaves) {
+            return cv::BRISK::create(30, octaves - 1);
+        }, max_keypoints);
+    case FeatureType::PHASH:
+        return std::make_unique<PHashBackend>();
+    }
+    return nullptr;
+}
+
+FeatureBackendPool::FeatureBackendPool(const FeatureType type, const i32 max_keypoints)
+    : backends([type, max_keypoints] { return create_feature_backend(type, max_keypoints); })
+{
+}
+
+FeatureBackend& FeatureBackendPool::local()
+{
+    return *backends.local();
+}
+
+// Every backend emits binary descriptors, AKAZE's MLDB included, so all of
+// them are compared bitwise by default. bench-matchers.sh checks the
+// agreement with FLANN.
+MatcherType default_matcher(FeatureType)
+{
+    return MatcherType::HAMMING;
+}
+
+} // namespace gazosan
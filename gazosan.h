@@ -5,11 +5,17 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
@@ -23,16 +29,14 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #ifdef ENABLE_PARALLEL
-#include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for_each.h>
 #include <tbb/global_control.h>
 #include <tbb/tbb.h>
-
-template<typename T>
-using vector = tbb::concurrent_vector<T>;
 #else
-template<typename T>
-using vector = std::vector<T>;
+#include <condition_variable>
+#include <functional>
+#include <thread>
 #endif
 
 namespace gazosan {
@@ -48,6 +52,246 @@ typedef int32_t i32;
 typedef int64_t i64;
 
 std::string_view errno_string();
+int open_input(const std::string& path);
+
+// Parallel primitives. With ENABLE_PARALLEL they are thin wrappers of TBB,
+// otherwise they run on the ThreadPool below.
+
+#ifndef ENABLE_PARALLEL
+// A work-stealing pool: every thread owns a task deque, pushes and pops at
+// its back, and steals from the front of the others when it runs dry.
+// Threads waiting for a TaskGroup run queued tasks meanwhile, so nested
+// parallel loops do not deadlock.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    static ThreadPool& instance();
+
+    ThreadPool();
+    ~ThreadPool();
+
+    // `threads` includes the calling thread, which owns deque 0 like all
+    // threads not started by the pool
+    void start(i32 threads);
+
+    void submit(Task task);
+    // blocks until `done` returns true, running queued tasks meanwhile
+    void wait_until(const std::function<bool()>& done);
+    // wakes the threads blocked in wait_until
+    void notify_all();
+
+    [[nodiscard]] i32 size() const
+    {
+        return static_cast<i32>(queues.size());
+    }
+
+    [[nodiscard]] static i32 current_index();
+
+private:
+    struct Queue {
+        std::mutex mu;
+        std::deque<Task> tasks;
+    };
+
+    bool run_one();
+    void work(i32 index);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<i64> queued = 0;
+    std::mutex sleep_mu;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+#endif
+
+class TaskGroup {
+public:
+    template <typename F>
+    void run(F&& fn)
+    {
+#ifdef ENABLE_PARALLEL
+        tg.run(std::forward<F>(fn));
+#else
+        pending++;
+        ThreadPool::instance().submit([this, fn = std::forward<F>(fn)]() mutable {
+            fn();
+            if (--pending == 0)
+                ThreadPool::instance().notify_all();
+        });
+#endif
+    }
+
+    void wait()
+    {
+#ifdef ENABLE_PARALLEL
+        tg.wait();
+#else
+        ThreadPool::instance().wait_until([this] { return pending == 0; });
+#endif
+    }
+
+private:
+#ifdef ENABLE_PARALLEL
+    tbb::task_group tg;
+#else
+    std::atomic<i64> pending = 0;
+#endif
+};
+
+inline i32 max_concurrency()
+{
+#ifdef ENABLE_PARALLEL
+    return tbb::this_task_arena::max_concurrency();
+#else
+    return ThreadPool::instance().size();
+#endif
+}
+
+inline i32 current_thread_index()
+{
+#ifdef ENABLE_PARALLEL
+    const int i = tbb::this_task_arena::current_thread_index();
+    return i == tbb::task_arena::not_initialized ? 0 : i;
+#else
+    return ThreadPool::current_index();
+#endif
+}
+
+// calls fn(i) for every i in [begin, end)
+template <typename Index, typename F>
+void parallel_for(const Index begin, const Index end, const F& fn)
+{
+#ifdef ENABLE_PARALLEL
+    tbb::parallel_for(begin, end, fn);
+#else
+    if (end <= begin)
+        return;
+    // a few chunks per thread, so that stealing can even out uneven work
+    const i64 n = static_cast<i64>(end - begin);
+    const i64 chunks = std::min<i64>(n, static_cast<i64>(max_concurrency()) * 4);
+    TaskGroup tg;
+    for (i64 c = 0; c < chunks; c++) {
+        const Index lo = begin + static_cast<Index>(n * c / chunks);
+        const Index hi = begin + static_cast<Index>(n * (c + 1) / chunks);
+        tg.run([&fn, lo, hi] {
+            for (Index i = lo; i < hi; i++)
+                fn(i);
+        });
+    }
+    tg.wait();
+#endif
+}
+
+// calls fn(x) for every element of a random access container
+template <typename Range, typename F>
+void parallel_for_each(Range& range, const F& fn)
+{
+#ifdef ENABLE_PARALLEL
+    tbb::parallel_for_each(range, fn);
+#else
+    parallel_for(static_cast<std::size_t>(0), range.size(), [&](const std::size_t i) { fn(range[i]); });
+#endif
+}
+
+// Passes the items [0, n) through `stages`, with at most `max_in_flight` of
+// them between the first and the last stage. The first stage runs in order,
+// on one item at a time; the others run concurrently.
+inline void parallel_pipeline(const i64 n, const i64 max_in_flight, const std::vector<std::function<void(i64)>>& stages)
+{
+    if (n == 0 || stages.empty())
+        return;
+#ifdef ENABLE_PARALLEL
+    i64 next = 0;
+    tbb::filter<void, i64> chain = tbb::make_filter<void, i64>(tbb::filter_mode::serial_in_order, [&](tbb::flow_control& fc) -> i64 {
+        if (next == n) {
+            fc.stop();
+            return 0;
+        }
+        stages[0](next);
+        return next++;
+    });
+    for (std::size_t s = 1; s < stages.size(); s++) {
+        chain = chain & tbb::make_filter<i64, i64>(tbb::filter_mode::parallel, [&stages, s](const i64 i) {
+            stages[s](i);
+            return i;
+        });
+    }
+    tbb::parallel_pipeline(max_in_flight, chain & tbb::make_filter<i64, void>(tbb::filter_mode::parallel, [](i64) { }));
+#else
+    // the caller runs the first stage, and helps with the others while it
+    // waits for a free slot
+    std::atomic<i64> in_flight = 0;
+    TaskGroup tg;
+    for (i64 i = 0; i < n; i++) {
+        ThreadPool::instance().wait_until([&] { return in_flight < max_in_flight; });
+        in_flight++;
+        stages[0](i);
+        tg.run([&, i] {
+            for (std::size_t s = 1; s < stages.size(); s++)
+                stages[s](i);
+            in_flight--;
+            ThreadPool::instance().notify_all();
+        });
+    }
+    tg.wait();
+#endif
+}
+
+// A lazily created instance of T per thread.
+template <typename T>
+class ThreadLocal {
+public:
+    ThreadLocal()
+        : ThreadLocal([] { return T(); })
+    {
+    }
+
+    explicit ThreadLocal(std::function<T()> init)
+#ifdef ENABLE_PARALLEL
+        : values(std::move(init))
+#else
+        : init(std::move(init))
+#endif
+    {
+    }
+
+    T& local()
+    {
+#ifdef ENABLE_PARALLEL
+        return values.local();
+#else
+        std::scoped_lock lock(mu);
+        auto it = values.find(std::this_thread::get_id());
+        if (it == values.end())
+            it = values.emplace(std::this_thread::get_id(), init()).first;
+        return it->second;
+#endif
+    }
+
+    // must not run concurrently with local()
+    template <typename F>
+    void for_each(const F& fn)
+    {
+        for (auto& value : values) {
+#ifdef ENABLE_PARALLEL
+            fn(value);
+#else
+            fn(value.second);
+#endif
+        }
+    }
+
+private:
+#ifdef ENABLE_PARALLEL
+    tbb::enumerable_thread_specific<T> values;
+#else
+    std::function<T()> init;
+    std::mutex mu;
+    std::unordered_map<std::thread::id, T> values;
+#endif
+};
 
 template <typename C>
 class SyncOut {
@@ -111,13 +355,18 @@ private:
     SyncOut<C> out;
 };
 
+i64 now_nsec();
+
 struct TimerRecord {
     TimerRecord(std::string name, TimerRecord* parent);
+    // a record of an interval measured by the caller, e.g. a parallel task
+    TimerRecord(std::string name, TimerRecord* parent, i64 start, i64 end);
     void stop();
 
     std::string name;
     TimerRecord* parent;
-    vector<TimerRecord*> children;
+    // linked by print_timer_records, after all threads are done
+    std::vector<TimerRecord*> children;
     i64 start;
     i64 end = 0;
     i64 user = 0;
@@ -125,7 +374,60 @@ struct TimerRecord {
     bool stopped = false;
 };
 
-void print_timer_records(vector<std::unique_ptr<TimerRecord>>&);
+// Timers are started from worker threads. Each thread appends to a buffer of
+// its own, and the buffers are merged once for printing.
+class TimerRecords {
+public:
+    void add(TimerRecord* rec)
+    {
+        buffers.local().emplace_back(rec);
+    }
+
+    // all records, ordered by start time. the records stay owned by the buffers.
+    std::vector<TimerRecord*> merge();
+
+private:
+    ThreadLocal<std::vector<std::unique_ptr<TimerRecord>>> buffers;
+};
+
+void print_timer_records(TimerRecords&);
+
+// Counter is used to collect statistics numbers for -perf.
+class Counter {
+public:
+    explicit Counter(std::string_view name, const i64 value = 0)
+        : name(name)
+        , value(value)
+    {
+        static std::mutex mu;
+        std::scoped_lock lock(mu);
+        instances.push_back(this);
+    }
+
+    Counter& operator++(int)
+    {
+        if (enabled)
+            value.fetch_add(1, std::memory_order_relaxed);
+        return *this;
+    }
+
+    Counter& operator+=(const i64 delta)
+    {
+        if (enabled)
+            value.fetch_add(delta, std::memory_order_relaxed);
+        return *this;
+    }
+
+    static void print();
+
+    static inline bool enabled = false;
+
+private:
+    std::string_view name;
+    std::atomic<i64> value;
+
+    static inline std::vector<Counter*> instances;
+};
 
 template <typename C>
 class Timer {
@@ -133,7 +435,7 @@ public:
     Timer(C& ctx, std::string name, Timer* parent = nullptr)
     {
         record = new TimerRecord(name, parent ? parent->record : nullptr);
-        ctx.timer_records.push_back(std::unique_ptr<TimerRecord>(record));
+        ctx.timer_records.add(record);
     }
 
     Timer(const Timer&) = delete;
@@ -148,10 +450,30 @@ public:
         record->stop();
     }
 
+    [[nodiscard]] TimerRecord* get_record() const
+    {
+        return record;
+    }
+
 private:
     TimerRecord* record;
 };
 
+// Memory for the contents of a file. It is left uninitialized, as the read
+// overwrites it anyway.
+struct ReadBuffer {
+    std::unique_ptr<u8[]> data;
+    i64 capacity = 0;
+
+    void reserve(const i64 size)
+    {
+        if (capacity < size) {
+            data.reset(new u8[size]);
+            capacity = size;
+        }
+    }
+};
+
 template <typename C>
 class MappedFile {
 public:
@@ -165,23 +487,38 @@ public:
         return { reinterpret_cast<char*>(data), size };
     }
 
+    // starts reading the file in the background, so that the first access to
+    // `data` does not wait for the disk
+    void prefetch() const
+    {
+        if (data && !in_memory)
+            madvise(data, size, MADV_WILLNEED);
+    }
+
     std::string name;
     u8* data = nullptr;
     i64 size = 0;
     i64 mtime = 0;
+
+    // read into `buffer` by a FileLoader instead of mapped
+    bool in_memory = false;
+    ReadBuffer buffer;
 };
 
 template <typename C>
 MappedFile<C>* MappedFile<C>::open(C& ctx, const std::string& path)
 {
-    const int fd = ::open(path.c_str(), O_RDONLY);
+    const int fd = open_input(path);
     if (fd == -1) {
         return nullptr;
     }
 
+    // failures leave errno set, for the caller to report
     struct stat st {};
-    if (fstat(fd, &st) == -1)
-        Fatal(ctx) << path << ": fstat failed: " << errno_string();
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return nullptr;
+    }
 
     auto* mf = new MappedFile;
     mf->name = path;
@@ -195,8 +532,14 @@ MappedFile<C>* MappedFile<C>::open(C& ctx, const std::string& path)
 #endif
     if (st.st_size > 0) {
         mf->data = static_cast<u8*>(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
-        if (mf->data == MAP_FAILED)
-            Fatal(ctx) << path << ": mmap failed: " << errno_string();
+        if (mf->data == MAP_FAILED) {
+            const int err = errno;
+            close(fd);
+            mf->size = 0;
+            delete mf;
+            errno = err;
+            return nullptr;
+        }
     }
     close(fd);
     return mf;
@@ -215,7 +558,7 @@ MappedFile<C>* MappedFile<C>::must_open(C& ctx, std::string path)
 template <typename C>
 MappedFile<C>::~MappedFile()
 {
-    if (size == 0)
+    if (size == 0 || in_memory)
         return;
 
     munmap(data, size);
@@ -224,22 +567,350 @@ MappedFile<C>::~MappedFile()
 class ImageSegment {
 public:
     cv::Rect area;
-    cv::Mat descriptor;
     cv::Mat roi; // gray
+    u64 hash = 0; // difference_hash of roi
+
+    // index of the first segment of the same image with identical pixels, or -1.
+    // a duplicate shares the descriptors of that segment.
+    i32 duplicate_of = -1;
 
-    bool matched = false;
+    // segment tree built from the RETR_CCOMP contour hierarchy.
+    // a segment is a child of the segment whose hole it lies in.
+    i32 parent = -1;
+    i32 depth = 0;
+    std::vector<i32> children;
 
     ImageSegment(const cv::Rect area, cv::Mat roi)
         : area(area)
         , roi(std::move(roi)) { };
-    ImageSegment(const cv::Rect area, cv::Mat descriptor, cv::Mat roi)
-        : area(area)
-        , descriptor(std::move(descriptor))
-        , roi(std::move(roi)) { };
 
     [[nodiscard]] cv::Rect rect_from(const cv::Point& upper_left) const;
 };
 
+// The segments of an image which matching has settled, by index. Kept apart
+// from the segments so that those can be shared read-only. Bits are set
+// concurrently while matching.
+class MatchedSet {
+public:
+    void reset(const std::size_t n)
+    {
+        words.assign((n + 63) / 64, 0);
+    }
+
+    [[nodiscard]] bool test(const i32 i) const
+    {
+        return std::atomic_ref(const_cast<u64&>(words[i / 64])).load(std::memory_order_relaxed) >> (i % 64) & 1;
+    }
+
+    void set(const i32 i)
+    {
+        std::atomic_ref(words[i / 64]).fetch_or(u64(1) << (i % 64), std::memory_order_relaxed);
+    }
+
+    void clear(const i32 i)
+    {
+        std::atomic_ref(words[i / 64]).fetch_and(~(u64(1) << (i % 64)), std::memory_order_relaxed);
+    }
+
+    // sets `i`; false if it was set already, by this or another thread
+    bool claim(const i32 i)
+    {
+        std::atomic_ref word(words[i / 64]);
+        const u64 bit = u64(1) << (i % 64);
+        u64 expected = word.load(std::memory_order_relaxed);
+        do {
+            if (expected & bit)
+                return false;
+        } while (!word.compare_exchange_strong(expected, expected | bit, std::memory_order_relaxed));
+        return true;
+    }
+
+private:
+    std::vector<u64> words;
+};
+
+// Claims old segment `i` and new segment `j` for each other, so that no
+// segment is matched twice however many identical ones compete for it.
+inline bool claim_match(MatchedSet& old_matched, const i32 i, MatchedSet& new_matched, const i32 j)
+{
+    if (!old_matched.claim(i))
+        return false;
+    if (new_matched.claim(j))
+        return true;
+    old_matched.clear(i);
+    return false;
+}
+
+enum class MatcherType {
+    L2,
+    HAMMING,
+    FLANN,
+};
+
+enum class FeatureType {
+    AKAZE,
+    ORB,
+    BRISK,
+    PHASH,
+};
+
+// FeatureBackend extracts the descriptors of a segment.
+class FeatureBackend {
+public:
+    virtual ~FeatureBackend() = default;
+
+    // returns one descriptor per row, or an empty matrix if `img` has no features
+    virtual cv::Mat compute(const cv::Mat& img) = 0;
+
+    // Local features of a large image can be computed on overlapping tiles.
+    // compute_within() then keeps only the features located inside `core`,
+    // so that the tiles' results can be concatenated. `share` is the part of
+    // the segment covered by `core`.
+    [[nodiscard]] virtual bool is_local() const
+    {
+        return false;
+    }
+
+    virtual cv::Mat compute_within(const cv::Mat& img, const cv::Rect& core, double share)
+    {
+        return compute(img);
+    }
+};
+
+std::unique_ptr<FeatureBackend> create_feature_backend(FeatureType type, i32 max_keypoints);
+
+// FeatureBackend is not thread-safe: cv::Feature2D implementations keep
+// scratch buffers (e.g. AKAZE's scale space) in the object between calls.
+// FeatureBackendPool hands out one backend per worker thread, created on its
+// first use. local() may be called from any thread concurrently; the returned
+// backend must only be used by the calling thread.
+class FeatureBackendPool {
+public:
+    FeatureBackendPool(FeatureType type, i32 max_keypoints);
+
+    FeatureBackend& local();
+
+private:
+    ThreadLocal<std::unique_ptr<FeatureBackend>> backends;
+};
+MatcherType default_matcher(FeatureType type);
+u64 content_hash(const cv::Mat& img);
+u64 difference_hash(const cv::Mat& img);
+
+// of the output images
+enum class ImageFormat {
+    PNG,
+    PPM,
+    QOI,
+};
+
+struct Context;
+
+// Reads the files of a batch into memory with io_uring, many at a time and
+// ahead of their use, so that the stages after reading never wait for the
+// disk. take() is called from one thread at a time, recycle() from any.
+class FileLoader {
+public:
+    // nullptr without io_uring: not built with it, or refused by the kernel
+    static std::unique_ptr<FileLoader> create(std::vector<std::string> paths, i64 ahead);
+
+    ~FileLoader();
+
+    // waits until paths[i] has been read. nullptr if it could not be.
+    MappedFile<Context>* take(std::size_t i);
+    // keeps the memory of a file from take() for later reads
+    void recycle(MappedFile<Context>& file);
+
+private:
+    struct Request;
+    struct Ring;
+
+    FileLoader() = default;
+    void submit();
+    void complete_one();
+
+    std::unique_ptr<Ring> ring;
+    std::vector<std::string> paths;
+    std::vector<Request> requests;
+    std::size_t next = 0; // of paths to submit
+    std::size_t taken = 0; // paths up to here have been asked for
+    i64 ahead = 0;
+    i64 in_flight = 0;
+
+    std::mutex free_mu;
+    std::vector<ReadBuffer> free_buffers;
+};
+
+// CPUs and memory available to the process, as limited by the affinity mask
+// and cgroups. 0 means unknown or unlimited.
+struct SystemLimits {
+    i64 online_cpus = 0;
+    i64 affinity_cpus = 0;
+    double cgroup_cpus = 0;
+    i64 physical_memory = 0;
+    i64 cgroup_memory = 0;
+
+    [[nodiscard]] i64 cpus() const;
+    [[nodiscard]] i64 memory() const;
+};
+
+// Files of tagged binary sections, for the caches and the baseline index.
+// Sections start at page boundaries, so that their contents can be used in
+// place from the read-only mapping.
+constexpr u32 section_file_version = 1;
+
+constexpr u32 section_tag(const char (&name)[5])
+{
+    return static_cast<u32>(name[0]) | static_cast<u32>(name[1]) << 8 | static_cast<u32>(name[2]) << 16 | static_cast<u32>(name[3]) << 24;
+}
+
+class SectionWriter {
+public:
+    // `data` must stay alive until write()
+    void add(u32 tag, const void* data, std::size_t size);
+
+    template <typename T>
+    void add(const u32 tag, const std::vector<T>& values)
+    {
+        add(tag, values.data(), values.size() * sizeof(T));
+    }
+
+    // for sections built on the fly
+    void add_copy(const u32 tag, const void* data, const std::size_t size)
+    {
+        const std::string& copy = copies.emplace_back(static_cast<const char*>(data), size);
+        add(tag, copy.data(), copy.size());
+    }
+
+    template <typename T>
+    void add_copy(const u32 tag, const std::vector<T>& values)
+    {
+        add_copy(tag, values.data(), values.size() * sizeof(T));
+    }
+
+    template <typename T>
+    void add_value(const u32 tag, const T& value)
+    {
+        add_copy(tag, &value, sizeof(T));
+    }
+
+    // writes a temporary file and renames it into place
+    bool write(const std::string& path, u64 key) const;
+
+private:
+    struct Section {
+        u32 tag;
+        const void* data;
+        std::size_t size;
+    };
+    std::vector<Section> sections;
+    std::deque<std::string> copies;
+};
+
+class SectionReader {
+public:
+    // nullptr if the file is missing, damaged or was written for another key
+    static std::unique_ptr<SectionReader> open(Context& ctx, const std::string& path, u64 key);
+
+    [[nodiscard]] std::optional<std::string_view> get(u32 tag) const;
+
+    // copies a section holding an array of T
+    template <typename T>
+    bool get(const u32 tag, std::vector<T>& out) const
+    {
+        const std::optional<std::string_view> section = get(tag);
+        if (!section || section->size() % sizeof(T) != 0)
+            return false;
+        out.resize(section->size() / sizeof(T));
+        std::memcpy(out.data(), section->data(), section->size());
+        return true;
+    }
+
+    template <typename T>
+    bool get_value(const u32 tag, T& out) const
+    {
+        const std::optional<std::string_view> section = get(tag);
+        if (!section || section->size() != sizeof(T))
+            return false;
+        std::memcpy(&out, section->data(), sizeof(T));
+        return true;
+    }
+
+    std::unique_ptr<MappedFile<Context>> file;
+
+private:
+    std::unordered_map<u32, std::string_view> sections;
+};
+
+u64 hash_bytes(const void* data, std::size_t size, u64 seed = 0);
+std::string hex_string(u64 value);
+// the file of a cache entry in -cache_dir
+std::string cache_path(const Context& ctx, u64 key, const std::string& suffix);
+
+// DescriptorStore holds the descriptors of all segments of an image in one
+// contiguous, 8 byte aligned array, so that the matchers stream through it.
+// Every feature backend emits binary descriptors, which are stored as their
+// bytes.
+class DescriptorStore {
+public:
+    DescriptorStore() = default;
+    // `descriptors[i]` are the descriptors of segments[i], empty for duplicates
+    DescriptorStore(const Context& ctx, const std::vector<ImageSegment>& segments, const std::vector<cv::Mat>& descriptors);
+
+    // `bits` may point into `data`
+    DescriptorStore(const DescriptorStore&) = delete;
+    DescriptorStore(DescriptorStore&&) = default;
+    DescriptorStore& operator=(DescriptorStore&&) = default;
+
+    [[nodiscard]] i32 rows_of(const i32 segment) const
+    {
+        return counts[segment];
+    }
+
+    [[nodiscard]] bool empty(const i32 segment) const
+    {
+        return counts[segment] == 0;
+    }
+
+    [[nodiscard]] const u8* row(const i32 r) const
+    {
+        return reinterpret_cast<const u8*>(bits) + static_cast<std::size_t>(r) * stride;
+    }
+
+    [[nodiscard]] const u64* row_bits(const i32 r) const
+    {
+        return &bits[static_cast<std::size_t>(r) * stride / 8];
+    }
+
+    [[nodiscard]] i32 words() const
+    {
+        return stride / 8;
+    }
+
+    // converts rows [begin, end) to CV_64F or CV_32F
+    void convert_rows(i32 begin, i32 end, int type, cv::Mat& out) const;
+
+    // write_to keeps pointers into the store until the writer is done.
+    // read_from can use the rows in place, if `reader` outlives the store.
+    void write_to(SectionWriter& writer) const;
+    bool read_from(const SectionReader& reader, bool in_place = false);
+
+    // a store using the rows of this one, which must outlive it
+    [[nodiscard]] DescriptorStore view() const;
+
+    i32 cols = 0; // bytes per descriptor
+    i32 stride = 0; // bytes per row, a multiple of 8
+    i32 rows = 0;
+    std::vector<u64> data;
+    const u64* bits = nullptr; // the rows: data.data(), or a mapped file
+    std::vector<double> norms; // squared L2 norm of each row, not kept for hamming
+
+    // rows of segment i are [offsets[i], offsets[i] + counts[i]). duplicates
+    // point to the rows of their representative.
+    std::vector<i32> offsets;
+    std::vector<i32> counts;
+};
+
 typedef struct Context {
     Context() = default;
 
@@ -248,45 +919,210 @@ typedef struct Context {
     struct {
         bool color_diagnostics = false;
         std::string new_file;
+        // every -new, glob patterns expanded. With more than one, each is
+        // compared against the old image (see compare_candidates).
+        std::vector<std::string> new_files;
         std::string old_file;
+        // trees of images paired by their relative paths (see compare_directories)
+        std::string old_dir;
+        std::string new_dir;
+        // an index written by `gazosan index`, in place of old_file
+        std::string old_index;
         std::string output_name;
+        ImageFormat output_format = ImageFormat::PNG;
+        bool build_index = false; // the `index` subcommand
         bool create_change_image = false;
 
         i32 bin_threshold = 200;
         bool cross_check = false;
+        FeatureType features = FeatureType::AKAZE;
+        i32 max_keypoints = 1000; // per segment, 0 for unlimited
+        MatcherType matcher = MatcherType::HAMMING;
+
+        // geometric tolerances of a candidate pair. 0 disables the check.
+        double size_tolerance = 4.0;
+        double aspect_tolerance = 4.0;
+        i32 position_tolerance = 0;
+        // max hamming distance of the segment hashes of a candidate pair, 64 to disable
+        i32 hash_tolerance = 16;
+
+        // keeps the segments and descriptors of old images (see
+        // detect_segments) and the results of compared pairs (journal.cc)
+        std::string cache_dir;
+        // keeps decoded pixels of input images, evicting the least recently
+        // used ones beyond pixel_cache_size bytes
+        std::string pixel_cache_dir;
+        i64 pixel_cache_size = 1024LL * 1024 * 1024;
 
         i64 thread_count = 0;
+        // 0 for the largest size within memory_budget
+        i32 descriptor_tile_size = 512;
+        // bytes, 0 for half of the memory available to the process
+        i64 memory_budget = 0;
+        bool side_arenas = false;
+        // pairs between reading and writing in compare_candidates
+        i64 max_in_flight = 0;
+        // read the files of a batch with FileLoader rather than mapping them
+#ifdef ENABLE_IO_URING
+        bool io_uring = true;
+#else
+        bool io_uring = false;
+#endif
         bool perf = false;
     } arg;
     std::vector<std::string_view> cmdline_args;
 
-    vector<std::unique_ptr<TimerRecord>> timer_records;
+    TimerRecords timer_records;
 
-    cv::Ptr<cv::AKAZE> algorithm = cv::AKAZE::create();
+    SystemLimits limits;
+    // Segments larger than this are split into tiles for the feature backends
+    // which support it, so that a single huge background segment does not keep
+    // one core busy while the others are idle. -descriptor_tile_size, or
+    // derived from the memory budget.
+    i32 descriptor_tile_size = 512;
+
+#ifdef ENABLE_PARALLEL
+    std::unique_ptr<tbb::global_control> parallelism;
+    // with -side_arenas, the work on each image runs in an arena of its own
+    std::unique_ptr<tbb::task_arena> old_arena;
+    std::unique_ptr<tbb::task_arena> new_arena;
+#endif
+
+    // shared by the candidates of compare_candidates
+    std::shared_ptr<FeatureBackendPool> features;
 
     std::unique_ptr<MappedFile<Context>> new_file;
     std::unique_ptr<MappedFile<Context>> old_file;
 
+    // the pixel cache entry old_color_mat and old_gray_mat point into, if any
+    std::unique_ptr<SectionReader> old_pixels;
+    // -old_index, which the old pixels, segments and descriptors point into
+    std::unique_ptr<SectionReader> old_index;
+    // the old segments and descriptors are there already, from -old_index or
+    // shared by compare_candidates
+    bool old_prepared = false;
+    // see old_input_hash
+    std::optional<u64> old_hash;
+
     cv::Mat new_color_mat;
     cv::Mat old_color_mat;
 
     cv::Mat new_gray_mat;
     cv::Mat old_gray_mat;
 
-    vector<ImageSegment> new_segments;
-    vector<ImageSegment> old_segments;
+    std::vector<ImageSegment> new_segments;
+    // shared by the pairs of a batch, which only read them
+    std::shared_ptr<const std::vector<ImageSegment>> old_segments = std::make_shared<const std::vector<ImageSegment>>();
+    // set by match_segments
+    MatchedSet new_matched;
+    MatchedSet old_matched;
+
+    DescriptorStore new_descriptors;
+    DescriptorStore old_descriptors;
+
+    // the two images are the same, so nothing was compared
+    bool unchanged = false;
+    // areas of the old image where a matched segment has changed pixels
+    std::vector<cv::Rect> changed_areas;
+    // the old image in gray, with the differences drawn in
+    cv::Mat diff_mat;
 } Context;
 
-std::size_t get_default_thread_count();
+// CandidateIndex buckets segments by size, aspect ratio and position, and
+// checks their hashes, so that only plausible pairs are handed to
+// descriptor_match.
+class CandidateIndex {
+public:
+    CandidateIndex(const Context& ctx, const std::vector<ImageSegment>& segments);
+
+    [[nodiscard]] std::vector<i32> find(const ImageSegment& query) const;
+
+private:
+    struct Key {
+        i32 size;
+        i32 aspect;
+        i32 x;
+        i32 y;
+    };
+
+    [[nodiscard]] Key key_of(const cv::Rect& area) const;
+    [[nodiscard]] bool is_plausible(const cv::Rect& a, const cv::Rect& b) const;
+    [[nodiscard]] static u64 hash_key(const Key& key);
+
+    const std::vector<ImageSegment>& segments;
+    double log_size_tolerance = 0;
+    double log_aspect_tolerance = 0;
+    i32 position_tolerance = 0;
+    i32 hash_tolerance = 64;
+    std::unordered_map<u64, std::vector<i32>> buckets;
+};
+
+void hamming_distances(const u64* query, const u64* train, i32 rows, i32 words, u32* out);
+
+// MatchDecisionCache remembers descriptor match decisions by content: a pair
+// of duplicates of already decided segments is not matched again. It may be
+// used from multiple threads.
+class MatchDecisionCache {
+public:
+    MatchDecisionCache(const std::vector<ImageSegment>& query_segments, const std::vector<ImageSegment>& train_segments)
+        : query_segments(query_segments)
+        , train_segments(train_segments)
+    {
+    }
+
+    // same as batch_descriptor_match
+    std::vector<i32> match(const Context& ctx, const DescriptorStore& query, i32 query_segment, const DescriptorStore& train, const std::vector<i32>& candidates);
+
+private:
+    const std::vector<ImageSegment>& query_segments;
+    const std::vector<ImageSegment>& train_segments;
+
+    std::mutex mu;
+    std::unordered_map<u64, bool> decisions;
+};
+
+SystemLimits detect_system_limits();
+std::size_t get_default_thread_count(const SystemLimits& limits);
+i64 get_default_memory_budget(const SystemLimits& limits);
+void init_parallelism(Context& ctx);
+void print_system_limits(const Context& ctx);
 
 void parse_args(Context& ctx);
-void load_image(Context& ctx);
+std::optional<std::string> load_image(Context& ctx);
 cv::Mat decode_from_mapped_file(const MappedFile<Context>& mapped_file, int flags);
+bool read_raw_frame(const MappedFile<Context>& file, cv::Mat& color, std::optional<std::string>& error);
+bool read_native_image(const MappedFile<Context>& file, cv::Mat& color, cv::Mat& gray);
+std::string output_path(const Context& ctx, const std::string& suffix);
+bool write_image(const Context& ctx, const std::string& path, const cv::Mat& image);
+bool reuse_result(Context& ctx);
+void record_result(Context& ctx);
+bool read_pixel_cache(Context& ctx, const MappedFile<Context>& file, cv::Mat& color, cv::Mat& gray, std::unique_ptr<SectionReader>& mapping);
+void write_pixel_cache(Context& ctx, const MappedFile<Context>& file, const cv::Mat& color, const cv::Mat& gray);
+void write_pixels(SectionWriter& writer, const cv::Mat& color, const cv::Mat& gray);
+bool read_pixels(const SectionReader& reader, cv::Mat& color, cv::Mat& gray);
+void build_index(Context& ctx);
+std::optional<std::string> compare_images(Context& ctx);
+bool compare_candidates(Context& ctx);
+bool compare_directories(Context& ctx);
+void load_index(Context& ctx);
+u64 old_input_hash(Context& ctx);
 std::variant<bool, std::string> check_histogram_differential(Context& ctx);
 
+struct SegmentArea {
+    cv::Rect rect;
+    i32 parent = -1; // index into the returned segments, -1 for roots
+};
+
+std::vector<SegmentArea> split_segments(Context& ctx, const cv::Mat& gray_mat, const cv::Mat& color_mat, i32 threshold);
 void detect_segments(Context& ctx);
+u64 segment_options_key(const Context& ctx);
+void write_old_segments(const Context& ctx, SectionWriter& writer);
+bool read_old_segments(Context& ctx, const SectionReader& reader, bool in_place);
 void save_segments(const Context& ctx);
 bool descriptor_match(const Context& ctx, const cv::Mat& descriptor1, const cv::Mat& descriptor2);
-void create_diff_image(Context& ctx);
+bool is_descriptor_match(const Context& ctx, std::vector<cv::DMatch>& match12, std::vector<cv::DMatch>& match21);
+std::vector<i32> batch_descriptor_match(const Context& ctx, const DescriptorStore& query, i32 query_segment, const DescriptorStore& train, const std::vector<i32>& train_segments);
+void match_segments(Context& ctx);
+std::optional<std::string> write_diff_images(Context& ctx);
 
 } // namespace gazosan
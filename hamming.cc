@@ -0,0 +1,101 @@
+#include "gazosan.h"
+
+#include <bit>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GAZOSAN_X86 1
+#endif
+
+namespace gazosan {
+
+typedef void (*HammingFn)(const u64*, const u64*, i32, i32, u32*);
+
+static void hamming_generic(const u64* query, const u64* train, const i32 rows, const i32 words, u32* out)
+{
+    for (i32 r = 0; r < rows; r++, train += words) {
+        u32 d = 0;
+        for (i32 w = 0; w < words; w++)
+            d += std::popcount(query[w] ^ train[w]);
+        out[r] = d;
+    }
+}
+
+#ifdef GAZOSAN_X86
+__attribute__((target("popcnt"))) static void hamming_popcnt(const u64* query, const u64* train, const i32 rows, const i32 words, u32* out)
+{
+    for (i32 r = 0; r < rows; r++, train += words) {
+        u64 d = 0;
+        for (i32 w = 0; w < words; w++)
+            d += _mm_popcnt_u64(query[w] ^ train[w]);
+        out[r] = static_cast<u32>(d);
+    }
+}
+
+// popcount of each byte by a nibble lookup table, summed per 64 bit lane
+__attribute__((target("avx2,popcnt"))) static void hamming_avx2(const u64* query, const u64* train, const i32 rows, const i32 words, u32* out)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    const i32 vec_words = words & ~3;
+
+    for (i32 r = 0; r < rows; r++, train += words) {
+        __m256i acc = _mm256_setzero_si256();
+        for (i32 w = 0; w < vec_words; w += 4) {
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + w));
+            const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(train + w));
+            const __m256i x = _mm256_xor_si256(a, b);
+            const __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, low_mask));
+            const __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask));
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+        }
+
+        u64 d = static_cast<u64>(_mm256_extract_epi64(acc, 0)) + static_cast<u64>(_mm256_extract_epi64(acc, 1))
+            + static_cast<u64>(_mm256_extract_epi64(acc, 2)) + static_cast<u64>(_mm256_extract_epi64(acc, 3));
+        for (i32 w = vec_words; w < words; w++)
+            d += _mm_popcnt_u64(query[w] ^ train[w]);
+        out[r] = static_cast<u32>(d);
+    }
+}
+
+// an AKAZE MLDB descriptor (61 bytes) fits in a single 512 bit register
+__attribute__((target("avx512f,avx512vpopcntdq"))) static void hamming_avx512(const u64* query, const u64* train, const i32 rows, const i32 words, u32* out)
+{
+    for (i32 r = 0; r < rows; r++, train += words) {
+        __m512i acc = _mm512_setzero_si512();
+        for (i32 w = 0; w < words; w += 8) {
+            const __mmask8 mask = words - w >= 8 ? 0xff : static_cast<__mmask8>((1u << (words - w)) - 1);
+            const __m512i a = _mm512_maskz_loadu_epi64(mask, query + w);
+            const __m512i b = _mm512_maskz_loadu_epi64(mask, train + w);
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(a, b)));
+        }
+        out[r] = static_cast<u32>(_mm512_reduce_add_epi64(acc));
+    }
+}
+#endif
+
+static HammingFn select_hamming()
+{
+#ifdef GAZOSAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+        return hamming_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return hamming_avx2;
+    if (__builtin_cpu_supports("popcnt"))
+        return hamming_popcnt;
+#endif
+    return hamming_generic;
+}
+
+// Writes the hamming distances between `query` and each of `rows` rows of
+// `train` to `out`. Rows are `words` 64 bit words long.
+void hamming_distances(const u64* query, const u64* train, const i32 rows, const i32 words, u32* out)
+{
+    static const HammingFn fn = select_hamming();
+    fn(query, train, rows, words, out);
+}
+
+} // namespace gazosan
@@ -4,6 +4,8 @@
 
 #include "gazosan.h"
 
+#include <numeric>
+
 namespace gazosan {
 
 cv::Rect ImageSegment::rect_from(const cv::Point& upper_left) const
@@ -11,33 +13,79 @@ cv::Rect ImageSegment::rect_from(const cv::Point& upper_left) const
     return { upper_left, cv::Point(upper_left.x + area.width, upper_left.y + area.height) };
 }
 
-void load_image(Context& ctx)
+// Runs the work on the old and the new image concurrently, in their own
+// arenas with -side_arenas.
+template <typename OldFn, typename NewFn>
+static void run_sides(const Context& ctx, OldFn&& old_side, NewFn&& new_side)
 {
-    Timer t(ctx, "load image");
-
 #ifdef ENABLE_PARALLEL
-    tbb::task_group tg;
-    tg.run([&] {
+    if (ctx.old_arena && ctx.new_arena) {
+        tbb::task_group old_tg;
+        tbb::task_group new_tg;
+        ctx.old_arena->execute([&] { old_tg.run(old_side); });
+        ctx.new_arena->execute([&] { new_tg.run(new_side); });
+        ctx.old_arena->execute([&] { old_tg.wait(); });
+        ctx.new_arena->execute([&] { new_tg.wait(); });
+        return;
+    }
 #endif
-        if (!ctx.arg.new_file.empty()) {
-            ctx.new_file.reset(MappedFile<Context>::must_open(ctx, ctx.arg.new_file));
-            ctx.new_color_mat = decode_from_mapped_file(*ctx.new_file, cv::IMREAD_COLOR);
-            cv::cvtColor(ctx.new_color_mat, ctx.new_gray_mat, cv::COLOR_BGR2GRAY);
-        }
-#ifdef ENABLE_PARALLEL
-    });
 
-    tg.run([&] {
-#endif
-        if (!ctx.arg.old_file.empty()) {
-            ctx.old_file.reset(MappedFile<Context>::must_open(ctx, ctx.arg.old_file));
-            ctx.old_color_mat = decode_from_mapped_file(*ctx.old_file, cv::IMREAD_COLOR);
-            cv::cvtColor(ctx.old_color_mat, ctx.old_gray_mat, cv::COLOR_BGR2GRAY);
-        }
-#ifdef ENABLE_PARALLEL
-    });
+    TaskGroup tg;
+    tg.run(old_side);
+    tg.run(new_side);
     tg.wait();
-#endif
+}
+
+// Returns why an input cannot be used. One that fails to decode is left
+// empty instead, for check_histogram_differential to report.
+std::optional<std::string> load_image(Context& ctx)
+{
+    Timer t(ctx, "load image");
+    std::optional<std::string> old_error;
+    std::optional<std::string> new_error;
+
+    auto load = [&](const std::string& path, std::unique_ptr<MappedFile<Context>>& file, cv::Mat& color_mat, cv::Mat& gray_mat, std::unique_ptr<SectionReader>* pixels, std::optional<std::string>& error) {
+        if (path.empty())
+            return;
+        // read_pair may have opened it already
+        if (!file)
+            file.reset(MappedFile<Context>::open(ctx, path));
+        if (!file) {
+            error = "cannot open " + path + ": " + std::string(errno_string());
+            return;
+        }
+        // nothing to decode, nor to cache
+        if (read_raw_frame(*file, color_mat, error)) {
+            if (!error)
+                cv::cvtColor(color_mat, gray_mat, cv::COLOR_BGR2GRAY);
+            return;
+        }
+        if (read_native_image(*file, color_mat, gray_mat))
+            return;
+        if (pixels && read_pixel_cache(ctx, *file, color_mat, gray_mat, *pixels))
+            return;
+        color_mat = decode_from_mapped_file(*file, cv::IMREAD_COLOR);
+        cv::cvtColor(color_mat, gray_mat, cv::COLOR_BGR2GRAY);
+        if (pixels)
+            write_pixel_cache(ctx, *file, color_mat, gray_mat);
+    };
+
+    // Only the old image is cached: it is the baseline seen again and again,
+    // while new images are mostly one-off renders which would only push the
+    // baselines out of the cache.
+    std::unique_ptr<SectionReader>* old_pixels = ctx.arg.pixel_cache_dir.empty() ? nullptr : &ctx.old_pixels;
+    run_sides(
+        ctx,
+        [&] {
+            if (ctx.old_prepared)
+                return;
+            if (!ctx.arg.old_index.empty())
+                load_index(ctx);
+            else
+                load(ctx.arg.old_file, ctx.old_file, ctx.old_color_mat, ctx.old_gray_mat, old_pixels, old_error);
+        },
+        [&] { load(ctx.arg.new_file, ctx.new_file, ctx.new_color_mat, ctx.new_gray_mat, nullptr, new_error); });
+    return old_error ? old_error : new_error;
 }
 
 cv::Mat decode_from_mapped_file(const MappedFile<Context>& mapped_file, const int flags = cv::IMREAD_UNCHANGED)
@@ -74,7 +122,7 @@ std::variant<bool, std::string> check_histogram_differential(Context& ctx)
     return cv::compareHist(hist_old_mat, hist_new_mat, 1) - 0.00001 <= 1e-13;
 }
 
-std::vector<cv::Rect> split_segments(Context& ctx, const cv::Mat& gray_mat, const cv::Mat& color_mat, i32 threshold)
+std::vector<SegmentArea> split_segments(Context& ctx, const cv::Mat& gray_mat, const cv::Mat& color_mat, i32 threshold)
 {
     Timer t(ctx, "split segments");
 
@@ -115,12 +163,49 @@ std::vector<cv::Rect> split_segments(Context& ctx, const cv::Mat& gray_mat, cons
         return {};
     }
 
-    int labels = 0;
+    // label N is assigned to top_level[N - 1]
+    std::vector<int> top_level;
     cv::Mat markers = cv::Mat::zeros(grd_mat.rows, grd_mat.cols, CV_32SC1);
     for (int idx = 0; idx >= 0; idx = hierarchy[idx][0]) {
+        top_level.push_back(idx);
         // hierarchy index correspond with contours
-        cv::drawContours(markers, contours, idx, cv::Scalar::all(++labels), -1, cv::LINE_8, hierarchy, INT_MAX);
+        cv::drawContours(markers, contours, idx, cv::Scalar::all(static_cast<int>(top_level.size())), -1, cv::LINE_8, hierarchy, INT_MAX);
+    }
+
+    // RETR_CCOMP places a contour found inside a hole at the top level again,
+    // so recover the nesting: the parent of a top level contour is the owner
+    // of the smallest hole containing it.
+    std::vector<int> parent_label(top_level.size() + 1, 0);
+    {
+        struct Hole {
+            int contour;
+            int owner_label;
+            cv::Rect bounds;
+        };
+        std::vector<Hole> holes;
+        for (int label = 1; label <= static_cast<int>(top_level.size()); label++) {
+            for (int child = hierarchy[top_level[label - 1]][2]; child >= 0; child = hierarchy[child][0])
+                holes.push_back({ child, label, cv::boundingRect(contours[child]) });
+        }
+
+        for (int label = 1; label <= static_cast<int>(top_level.size()) && !holes.empty(); label++) {
+            const std::vector<cv::Point>& contour = contours[top_level[label - 1]];
+            const cv::Rect bounds = cv::boundingRect(contour);
+
+            int best_area = INT_MAX;
+            for (const Hole& hole : holes) {
+                if (hole.owner_label == label || hole.bounds.area() >= best_area)
+                    continue;
+                if ((hole.bounds & bounds) != bounds)
+                    continue;
+                if (cv::pointPolygonTest(contours[hole.contour], contour[0], false) < 0)
+                    continue;
+                best_area = hole.bounds.area();
+                parent_label[label] = hole.owner_label;
+            }
+        }
     }
+
     markers = markers + 1;
     // "watershed" regard 0 as unknown, so set un-labeled area to 1
     cv::watershed(color_mat, markers);
@@ -173,75 +258,421 @@ std::vector<cv::Rect> split_segments(Context& ctx, const cv::Mat& gray_mat, cons
 
     Timer t_grouping(ctx, "grouping", &t);
     // grouping pixels and calculate group rectangle
-    std::vector<cv::Rect> segments;
+    std::vector<SegmentArea> segments;
+    std::vector<int> segment_labels;
+    std::vector<i32> segment_of_label(top_level.size() + 1, -1);
 
     for (int y = 0; y < markers.rows; y++) {
         for (int x = 0; x < markers.cols; x++) {
             if (markers.at<int>(y, x) <= 1)
                 continue;
 
-            if (auto rect = bfs(x, y, bfs))
-                segments.push_back(*rect);
+            // "watershed" markers are shifted by one from the contour labels
+            const int label = markers.at<int>(y, x) - 1;
+            if (auto rect = bfs(x, y, bfs)) {
+                if (segment_of_label[label] < 0)
+                    segment_of_label[label] = static_cast<i32>(segments.size());
+                segments.push_back({ *rect });
+                segment_labels.push_back(label);
+            }
+        }
+    }
+
+    // link segments along the contour nesting, skipping contours which did
+    // not survive as a segment of their own
+    for (std::size_t i = 0; i < segments.size(); i++) {
+        int steps = 0;
+        for (int label = parent_label[segment_labels[i]]; label > 0 && steps++ < static_cast<int>(top_level.size()); label = parent_label[label]) {
+            if (segment_of_label[label] >= 0 && segment_of_label[label] != static_cast<i32>(i)) {
+                segments[i].parent = segment_of_label[label];
+                break;
+            }
         }
     }
 
     return segments;
 }
 
+static void build_segment_tree(std::vector<ImageSegment>& segments)
+{
+    const auto n = static_cast<i32>(segments.size());
+    for (auto& segment : segments) {
+        segment.depth = 0;
+        for (i32 p = segment.parent; p >= 0 && segment.depth <= n; p = segments[p].parent)
+            segment.depth++;
+        // degenerate contours may produce a cycle, cut it here
+        if (segment.depth > n) {
+            segment.parent = -1;
+            segment.depth = 0;
+        }
+    }
+
+    for (i32 i = 0; i < n; i++) {
+        ImageSegment& segment = segments[i];
+        segment.depth = 0;
+        for (i32 p = segment.parent; p >= 0; p = segments[p].parent)
+            segment.depth++;
+        if (segment.parent >= 0)
+            segments[segment.parent].children.push_back(i);
+    }
+}
+
+static void mark_subtree_matched(const std::vector<ImageSegment>& segments, MatchedSet& matched, const i32 root)
+{
+    std::vector<i32> stack(segments[root].children.begin(), segments[root].children.end());
+    while (!stack.empty()) {
+        const i32 i = stack.back();
+        stack.pop_back();
+        matched.set(i);
+        stack.insert(stack.end(), segments[i].children.begin(), segments[i].children.end());
+    }
+}
+
+static Counter num_duplicate_segments("duplicate_segments");
+
+// Pages repeat the same component many times (list rows, avatars, icons).
+// Segments with byte-identical ROIs are linked to the first one of their
+// kind, which is the only one to get its descriptors computed.
+static void find_duplicate_segments(std::vector<ImageSegment>& segments)
+{
+    std::vector<u64> hashes(segments.size());
+    parallel_for(static_cast<std::size_t>(0), segments.size(), [&](const std::size_t i) { hashes[i] = content_hash(segments[i].roi); });
+
+    auto same_content = [](const cv::Mat& a, const cv::Mat& b) {
+        if (a.size() != b.size() || a.type() != b.type())
+            return false;
+        const std::size_t row_bytes = a.cols * a.elemSize();
+        for (int y = 0; y < a.rows; y++) {
+            if (std::memcmp(a.ptr(y), b.ptr(y), row_bytes) != 0)
+                return false;
+        }
+        return true;
+    };
+
+    std::unordered_map<u64, std::vector<i32>> representatives;
+    for (i32 i = 0; i < static_cast<i32>(segments.size()); i++) {
+        if (segments[i].roi.empty())
+            continue;
+        std::vector<i32>& candidates = representatives[hashes[i]];
+        for (const i32 r : candidates) {
+            if (same_content(segments[r].roi, segments[i].roi)) {
+                segments[i].duplicate_of = r;
+                num_duplicate_segments++;
+                break;
+            }
+        }
+        if (segments[i].duplicate_of < 0)
+            candidates.push_back(i);
+    }
+}
+
+// A unit of descriptor work: a whole segment, or one tile of a large one.
+struct DescriptorTask {
+    ImageSegment* segment;
+    cv::Mat* output; // descriptors of the whole segment
+    cv::Rect tile; // in roi coordinates
+    cv::Rect core; // in tile coordinates, features outside of it are dropped
+    i64 cost;
+    cv::Mat descriptor;
+};
+
+// Tiles overlap so that features near a tile edge still see their whole
+// neighbourhood in one of the tiles.
+static constexpr int descriptor_tile_margin = 48;
+
+static Counter num_descriptor_tasks("descriptor_tasks");
+static Counter num_tiled_segments("tiled_segments");
+
+static void add_descriptor_tasks(const Context& ctx, ImageSegment& segment, cv::Mat& output, std::vector<DescriptorTask>& tasks)
+{
+    const int w = segment.roi.cols;
+    const int h = segment.roi.rows;
+    const int descriptor_tile_size = ctx.descriptor_tile_size;
+    if (!ctx.features->local().is_local() || (w <= descriptor_tile_size && h <= descriptor_tile_size)) {
+        tasks.push_back({ &segment, &output, cv::Rect(0, 0, w, h), cv::Rect(0, 0, w, h), static_cast<i64>(w) * h });
+        return;
+    }
+
+    num_tiled_segments++;
+    for (int y = 0; y < h; y += descriptor_tile_size) {
+        for (int x = 0; x < w; x += descriptor_tile_size) {
+            const cv::Rect core(x, y, std::min(descriptor_tile_size, w - x), std::min(descriptor_tile_size, h - y));
+            const int x0 = std::max(0, core.x - descriptor_tile_margin);
+            const int y0 = std::max(0, core.y - descriptor_tile_margin);
+            const int x1 = std::min(w, core.x + core.width + descriptor_tile_margin);
+            const int y1 = std::min(h, core.y + core.height + descriptor_tile_margin);
+            const cv::Rect tile(x0, y0, x1 - x0, y1 - y0);
+            tasks.push_back({ &segment, &output, tile, cv::Rect(core.x - x0, core.y - y0, core.width, core.height), static_cast<i64>(tile.area()) });
+        }
+    }
+}
+
+// Bump when a change alters the segments or descriptors of an image.
+static constexpr u32 segment_cache_version = 3;
+
+// What the segment cache keeps of a segment; the tree is rebuilt.
+struct CachedSegment {
+    i32 x;
+    i32 y;
+    i32 width;
+    i32 height;
+    i32 parent;
+    i32 duplicate_of;
+    u64 hash;
+};
+
+static Counter num_segment_cache_hits("segment_cache_hits");
+
+// every option that influences the segments and descriptors of an image
+u64 segment_options_key(const Context& ctx)
+{
+    u64 key = 0;
+    auto add = [&](const auto& value) { key = hash_bytes(&value, sizeof(value), key); };
+    add(segment_cache_version);
+    add(ctx.arg.bin_threshold);
+    add(ctx.arg.features);
+    // the norms are only kept for the float matchers
+    add(ctx.arg.matcher);
+    add(ctx.arg.max_keypoints);
+    // feature detectors change between OpenCV versions
+    return hash_bytes(CV_VERSION, std::strlen(CV_VERSION), key);
+}
+
+// The tile size is left out of segment_options_key, an index records the
+// one it was built with. The local cache is keyed on it instead.
+static u64 old_side_key(Context& ctx)
+{
+    const u64 options = segment_options_key(ctx);
+    const u64 key = hash_bytes(&ctx.descriptor_tile_size, sizeof(ctx.descriptor_tile_size), options);
+    return hash_bytes(&key, sizeof(key), old_input_hash(ctx));
+}
+
+// Needs ctx.old_gray_mat. With `in_place`, the descriptors point into
+// `reader`, which must outlive them. The new image is then tiled like the
+// old one was.
+bool read_old_segments(Context& ctx, const SectionReader& reader, const bool in_place)
+{
+    std::vector<CachedSegment> cached;
+    DescriptorStore descriptors;
+    i32 tile_size = 0;
+    if (!reader.get(section_tag("SEGS"), cached) || !reader.get_value(section_tag("SGTS"), tile_size) || tile_size <= 0
+        || !descriptors.read_from(reader, in_place) || descriptors.offsets.size() != cached.size())
+        return false;
+
+    const cv::Rect image(0, 0, ctx.old_gray_mat.cols, ctx.old_gray_mat.rows);
+    const i32 n = static_cast<i32>(cached.size());
+    for (const CachedSegment& c : cached) {
+        const cv::Rect area(c.x, c.y, c.width, c.height);
+        if (area.empty() || (area & image) != area || c.parent < -1 || c.parent >= n || c.duplicate_of < -1 || c.duplicate_of >= n)
+            return false;
+    }
+
+    std::vector<ImageSegment> segments;
+    segments.reserve(cached.size());
+    for (const CachedSegment& c : cached) {
+        const cv::Rect area(c.x, c.y, c.width, c.height);
+        ImageSegment& segment = segments.emplace_back(area, ctx.old_gray_mat(area));
+        segment.parent = c.parent;
+        segment.duplicate_of = c.duplicate_of;
+        segment.hash = c.hash;
+    }
+    build_segment_tree(segments);
+    ctx.old_segments = std::make_shared<const std::vector<ImageSegment>>(std::move(segments));
+    ctx.old_descriptors = std::move(descriptors);
+    ctx.descriptor_tile_size = tile_size;
+    return true;
+}
+
+void write_old_segments(const Context& ctx, SectionWriter& writer)
+{
+    std::vector<CachedSegment> cached;
+    cached.reserve(ctx.old_segments->size());
+    for (const ImageSegment& segment : *ctx.old_segments) {
+        const cv::Rect& a = segment.area;
+        cached.push_back({ a.x, a.y, a.width, a.height, segment.parent, segment.duplicate_of, segment.hash });
+    }
+    writer.add_copy(section_tag("SEGS"), cached);
+    writer.add_value(section_tag("SGTS"), ctx.descriptor_tile_size);
+    ctx.old_descriptors.write_to(writer);
+}
+
+static bool read_segment_cache(Context& ctx, const std::string& path, const u64 key)
+{
+    const std::unique_ptr<SectionReader> reader = SectionReader::open(ctx, path, key);
+    if (!reader || !read_old_segments(ctx, *reader, false))
+        return false;
+    num_segment_cache_hits++;
+    return true;
+}
+
+static void write_segment_cache(const Context& ctx, const std::string& path, const u64 key)
+{
+    SectionWriter writer;
+    write_old_segments(ctx, writer);
+    // the cache is an optimization, a failure to write it is not an error
+    writer.write(path, key);
+}
+
 void detect_segments(Context& ctx)
 {
     Timer t(ctx, "detect segments");
 
-    auto compute_descriptor = [&ctx](const cv::Mat& img) -> std::optional<cv::Mat> {
-        if (img.empty())
-            return std::nullopt;
-
-        std::vector<cv::KeyPoint> keypoint;
-        cv::Mat descriptor;
-        ctx.algorithm->detect(img, keypoint);
-        if (keypoint.empty())
-            return std::nullopt;
+    // The old image is usually a baseline compared against many new images,
+    // so its segments and descriptors are cached in -cache_dir.
+    std::string cache_file;
+    u64 cache_key = 0;
+    bool old_cached = ctx.old_prepared;
+    if (!old_cached && !ctx.arg.cache_dir.empty()) {
+        Timer t2(ctx, "read segment cache", &t);
+        cache_key = old_side_key(ctx);
+        cache_file = cache_path(ctx, cache_key, ".seg");
+        old_cached = read_segment_cache(ctx, cache_file, cache_key);
+    }
 
-        ctx.algorithm->compute(img, keypoint, descriptor);
-        descriptor.convertTo(descriptor, CV_32F);
-        return descriptor;
+    auto do_split = [&](const cv::Mat& gray_mat, const cv::Mat& color_mat, std::vector<ImageSegment>& result) {
+        // `gazosan index` has no new image
+        if (gray_mat.empty())
+            return;
+        Timer t2(ctx, "do split", &t);
+        const std::vector<SegmentArea> areas = split_segments(ctx, gray_mat, color_mat, ctx.arg.bin_threshold);
+        result.reserve(areas.size());
+        for (const auto& segment : areas) {
+            auto roi = gray_mat(segment.rect);
+            result.emplace_back(segment.rect, roi);
+            result.back().parent = segment.parent;
+        }
+        build_segment_tree(result);
+        find_duplicate_segments(result);
     };
 
-    auto do_detect = [&](const cv::Mat& gray_mat, const cv::Mat& color_mat, vector<ImageSegment>& result) {
-        Timer t2(ctx, "do detect", &t);
-        for (auto segment : split_segments(ctx, gray_mat, color_mat, ctx.arg.bin_threshold)) {
-            auto roi = gray_mat(segment);
-            result.emplace_back(segment, roi);
+    // published in ctx.old_segments once complete
+    std::vector<ImageSegment> old_segments;
+    run_sides(
+        ctx,
+        [&] {
+            if (!old_cached)
+                do_split(ctx.old_gray_mat, ctx.old_color_mat, old_segments);
+        },
+        [&] { do_split(ctx.new_gray_mat, ctx.new_color_mat, ctx.new_segments); });
+
+    Timer t_compute(ctx, "compute descriptors", &t);
+
+    // descriptors are collected per segment, then moved into the stores
+    std::vector<cv::Mat> old_descriptors(old_segments.size());
+    std::vector<cv::Mat> new_descriptors(ctx.new_segments.size());
+
+    // tiles of a segment are consecutive in `tasks`
+    std::vector<DescriptorTask> tasks;
+    auto add_tasks = [&](std::vector<ImageSegment>& segments, std::vector<cv::Mat>& descriptors) {
+        for (std::size_t i = 0; i < segments.size(); i++) {
+            if (segments[i].duplicate_of < 0)
+                add_descriptor_tasks(ctx, segments[i], descriptors[i], tasks);
+        }
+    };
+    if (!old_cached)
+        add_tasks(old_segments, old_descriptors);
+    add_tasks(ctx.new_segments, new_descriptors);
+    num_descriptor_tasks += static_cast<i64>(tasks.size());
+
+    // Largest first, pulled one by one by the workers: the expensive tasks
+    // start early and the small ones fill up the gaps at the end.
+    std::vector<i32> order(tasks.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::stable_sort(order, [&](const i32 a, const i32 b) { return tasks[a].cost > tasks[b].cost; });
+
+    std::vector<i64> durations(tasks.size());
+    std::vector<i64> starts(tasks.size());
+    auto run_task = [&](const i32 k) {
+        DescriptorTask& task = tasks[k];
+        starts[k] = now_nsec();
+        if (!task.tile.empty()) {
+            FeatureBackend& backend = ctx.features->local();
+            const cv::Mat img = task.segment->roi(task.tile);
+            if (task.tile.size() == task.segment->roi.size() && task.core == task.tile)
+                task.descriptor = backend.compute(img);
+            else
+                task.descriptor = backend.compute_within(img, task.core, static_cast<double>(task.core.area()) / task.segment->area.area());
         }
+        durations[k] = now_nsec() - starts[k];
+    };
 
-        Timer t4(ctx, "compute descriptors", &t2);
-#ifdef ENABLE_PARALLEL
-        tbb::parallel_for_each(result, [&](ImageSegment& segment) {
-            if (const auto desc = compute_descriptor(segment.roi))
-                segment.descriptor = *desc;
+    std::atomic<std::size_t> next = 0;
+    TaskGroup workers;
+    for (i32 w = 0; w < max_concurrency(); w++) {
+        workers.run([&] {
+            for (std::size_t i = next++; i < order.size(); i = next++)
+                run_task(order[i]);
         });
-#else
-        for (auto &segment : result) {
-            if (const auto desc = compute_descriptor(segment.roi))
-                segment.descriptor = *desc;
+    }
+    workers.wait();
+
+    // merge tiles and hash the segments
+    auto finish_segment = [&](const std::size_t first, const std::size_t last) {
+        ImageSegment& segment = *tasks[first].segment;
+        segment.hash = difference_hash(segment.roi);
+
+        std::vector<cv::Mat> parts;
+        for (std::size_t k = first; k < last; k++) {
+            if (!tasks[k].descriptor.empty())
+                parts.push_back(tasks[k].descriptor);
         }
-#endif
+        if (parts.size() == 1)
+            *tasks[first].output = parts[0];
+        else if (parts.size() > 1)
+            cv::vconcat(parts.data(), parts.size(), *tasks[first].output);
     };
 
-#ifdef ENABLE_PARALLEL
-    tbb::task_group tg;
-    tg.run([&]() { do_detect(ctx.old_gray_mat, ctx.old_color_mat, ctx.old_segments); });
-    tg.run([&]() { do_detect(ctx.new_gray_mat, ctx.new_color_mat, ctx.new_segments); });
-    tg.wait();
-#else
-    do_detect(ctx.old_gray_mat, ctx.old_color_mat, ctx.old_segments);
-    do_detect(ctx.new_gray_mat, ctx.new_color_mat, ctx.new_segments);
-#endif
+    std::vector<std::pair<std::size_t, std::size_t>> groups;
+    for (std::size_t first = 0; first < tasks.size();) {
+        std::size_t last = first + 1;
+        while (last < tasks.size() && tasks[last].segment == tasks[first].segment)
+            last++;
+        groups.emplace_back(first, last);
+        first = last;
+    }
+    parallel_for_each(groups, [&](const std::pair<std::size_t, std::size_t>& g) { finish_segment(g.first, g.second); });
+
+    // duplicates share the results of their representative
+    for (std::vector<ImageSegment>* segments : { &old_segments, &ctx.new_segments }) {
+        for (auto& segment : *segments) {
+            if (segment.duplicate_of >= 0)
+                segment.hash = (*segments)[segment.duplicate_of].hash;
+        }
+    }
+    t_compute.stop();
+
+    Timer t_store(ctx, "store descriptors", &t);
+    if (!old_cached) {
+        ctx.old_descriptors = DescriptorStore(ctx, old_segments, old_descriptors);
+        ctx.old_segments = std::make_shared<const std::vector<ImageSegment>>(std::move(old_segments));
+    }
+    ctx.new_descriptors = DescriptorStore(ctx, ctx.new_segments, new_descriptors);
+    t_store.stop();
+
+    if (!cache_file.empty() && !old_cached) {
+        Timer t2(ctx, "write segment cache", &t);
+        write_segment_cache(ctx, cache_file, cache_key);
+    }
+
+    // show the slowest tasks under "compute descriptors" to make an imbalance visible
+    if (ctx.arg.perf) {
+        constexpr std::size_t slowest = 5;
+        std::vector<i32> by_time(tasks.size());
+        std::iota(by_time.begin(), by_time.end(), 0);
+        std::ranges::sort(by_time, [&](const i32 a, const i32 b) { return durations[a] > durations[b]; });
+        for (std::size_t i = 0; i < std::min(slowest, by_time.size()); i++) {
+            const DescriptorTask& task = tasks[by_time[i]];
+            std::stringstream name;
+            name << "task " << task.tile.width << "x" << task.tile.height
+                 << " at " << task.segment->area.x + task.tile.x << "," << task.segment->area.y + task.tile.y;
+            ctx.timer_records.add(new TimerRecord(name.str(), t_compute.get_record(), starts[by_time[i]], starts[by_time[i]] + durations[by_time[i]]));
+        }
+    }
 }
 
 void save_segments(const Context& ctx)
 {
-    auto do_save = [&](const std::string& prefix, const cv::Mat& base_mat, const vector<ImageSegment>& segments) {
+    auto do_save = [&](const std::string& prefix, const cv::Mat& base_mat, const std::vector<ImageSegment>& segments) {
         for (int i = 0; const auto& image_segment : segments) {
             i++;
 
@@ -250,7 +681,7 @@ void save_segments(const Context& ctx)
         }
     };
 
-    do_save("old", ctx.old_color_mat, ctx.old_segments);
+    do_save("old", ctx.old_color_mat, *ctx.old_segments);
     do_save("new", ctx.new_color_mat, ctx.new_segments);
 }
 
@@ -258,10 +689,22 @@ bool descriptor_match(const Context& ctx, const cv::Mat& descriptor1, const cv::
 {
     const auto matcher = cv::DescriptorMatcher::create(cv::DescriptorMatcher::FLANNBASED);
 
+    // FLANN's KD-tree only consumes float descriptors
+    cv::Mat float1 = descriptor1, float2 = descriptor2;
+    if (descriptor1.type() != CV_32F)
+        descriptor1.convertTo(float1, CV_32F);
+    if (descriptor2.type() != CV_32F)
+        descriptor2.convertTo(float2, CV_32F);
+
     std::vector<cv::DMatch> match12, match21;
-    matcher->match(descriptor1, descriptor2, match12);
-    matcher->match(descriptor2, descriptor1, match21);
+    matcher->match(float1, float2, match12);
+    matcher->match(float2, float1, match21);
+    return is_descriptor_match(ctx, match12, match21);
+}
 
+// match12 and match21 are nearest neighbours indexed by their query index
+bool is_descriptor_match(const Context& ctx, std::vector<cv::DMatch>& match12, std::vector<cv::DMatch>& match21)
+{
     if (ctx.arg.cross_check) {
         std::vector<cv::DMatch> matched;
         for (auto forward : match12) {
@@ -281,100 +724,175 @@ bool descriptor_match(const Context& ctx, const cv::Mat& descriptor1, const cv::
     return (!match12.empty() && match12[match12.size() / 2].distance <= threshold) || (!match21.empty() && match21[match21.size() / 2].distance <= threshold);
 }
 
-void create_diff_image(Context& ctx)
+// Matches the segments of the two images and draws the differences into
+// ctx.diff_mat.
+void match_segments(Context& ctx)
 {
-    Timer t(ctx, "create diff image");
+    Timer t(ctx, "match segments");
 
-    cv::Mat result;
+    const std::vector<ImageSegment>& old_segments = *ctx.old_segments;
+    ctx.old_matched.reset(old_segments.size());
+    ctx.new_matched.reset(ctx.new_segments.size());
+
+    cv::Mat& result = ctx.diff_mat;
     const cv::Mat temp[] = { ctx.old_gray_mat, ctx.old_gray_mat, ctx.old_gray_mat };
     cv::merge(temp, 3, result);
 
-#ifdef ENABLE_PARALLEL
-    tbb::parallel_for_each(ctx.old_segments, [&](ImageSegment& image_segment1) {
-#else
-    for (auto image_segment1 : ctx.old_segments) {
-#endif
-        if (image_segment1.descriptor.empty() || image_segment1.matched)
-            return;
-#ifdef ENABLE_PARALLEL
-        tbb::parallel_for_each(ctx.new_segments, [&](ImageSegment& image_segment2) {
-#else
-        for (auto image_segment2: ctx.new_segments) {
-#endif
-            if (image_segment2.descriptor.empty() || image_segment2.matched || !descriptor_match(ctx, image_segment1.descriptor, image_segment2.descriptor))
+    // pairs are compared concurrently, but may overlap in `result`
+    std::mutex result_mu;
+
+    // claims old segment `i` and new segment `j`, a matched pair, and draws
+    // their differences. returns the location of `new` in `old` if it was
+    // found there without any pixel difference. nothing is drawn if either
+    // segment was claimed by another pair first.
+    auto compare_segments = [&](const i32 i, const i32 j) -> std::optional<cv::Rect> {
+        if (!claim_match(ctx.old_matched, i, ctx.new_matched, j))
+            return std::nullopt;
+        const ImageSegment& image_segment2 = ctx.new_segments[j];
+
+        // find `new` parts from `old` image
+        cv::Mat ret;
+        cv::Point min_point;
+        cv::matchTemplate(ctx.old_gray_mat, image_segment2.roi, ret, cv::TM_SQDIFF);
+        cv::minMaxLoc(ret, nullptr, nullptr, &min_point, nullptr);
+        // Note: パーツのマッチングから対応する位置関係を取得できないか？
+
+        const auto area = image_segment2.area;
+        const auto rect = image_segment2.rect_from(min_point);
+        std::vector<cv::Point> differences;
+        for (int i = 0; i < rect.height; i++) {
+            for (int j = 0; j < rect.width; j++) {
+                auto old_cropped = ctx.old_color_mat.at<cv::Vec3b>(i + rect.y, j + rect.x);
+                auto new_cropped = ctx.new_color_mat.at<cv::Vec3b>(i + area.y, j + area.x);
+
+                if (old_cropped != new_cropped)
+                    differences.emplace_back(j + rect.x, i + rect.y);
+            }
+        }
+
+        std::scoped_lock lock(result_mu);
+        cv::rectangle(result, rect, CV_RGB(255, 0, 0), 1);
+        for (const cv::Point& p : differences)
+            result.at<cv::Vec3b>(p.y, p.x) = cv::Vec3b(0, 0, 255);
+        if (!differences.empty())
+            ctx.changed_areas.push_back(rect);
+
+        if (!differences.empty())
+            return std::nullopt;
+        return rect;
+    };
+
+    // Match the segment trees top-down. A pair is compared at the level of the
+    // deeper of the two segments, so parents are always tried before their
+    // children. When a parent is found unchanged, its children are settled
+    // without descriptor matching.
+    Timer t_candidates(ctx, "find candidates", &t);
+    const CandidateIndex index(ctx, ctx.new_segments);
+    std::vector<std::vector<i32>> candidates(old_segments.size());
+    auto find_candidates = [&](const i32 i) {
+        if (!ctx.old_descriptors.empty(i))
+            candidates[i] = index.find(old_segments[i]);
+    };
+    parallel_for(static_cast<i32>(0), static_cast<i32>(old_segments.size()), find_candidates);
+    t_candidates.stop();
+
+    const DescriptorStore& old_descriptors = ctx.old_descriptors;
+    const DescriptorStore& new_descriptors = ctx.new_descriptors;
+    MatchDecisionCache decisions(old_segments, ctx.new_segments);
+
+    i32 max_depth = 0;
+    for (const auto& segment : old_segments)
+        max_depth = std::max(max_depth, segment.depth);
+    for (const auto& segment : ctx.new_segments)
+        max_depth = std::max(max_depth, segment.depth);
+
+    for (i32 depth = 0; depth <= max_depth; depth++) {
+        struct CleanMatch {
+            i32 old_index;
+            i32 new_index;
+            bool same_area;
+        };
+        // rare, so a lock is cheaper than per-thread buffers
+        std::vector<CleanMatch> clean_matches;
+        std::mutex clean_matches_mu;
+
+        auto match_old = [&](const i32 i) {
+            const ImageSegment& image_segment1 = old_segments[i];
+            if (image_segment1.depth > depth || old_descriptors.empty(i) || ctx.old_matched.test(i))
                 return;
 
-            image_segment1.matched = true;
-            image_segment2.matched = true;
-
-            // find `new` parts from `old` image
-            cv::Mat ret;
-            cv::Point min_point;
-            cv::matchTemplate(ctx.old_gray_mat, image_segment2.roi, ret, cv::TM_SQDIFF);
-            cv::minMaxLoc(ret, nullptr, nullptr, &min_point, nullptr);
-            // Note: パーツのマッチングから対応する位置関係を取得できないか？
-
-            const auto area = image_segment2.area;
-            const auto rect = image_segment2.rect_from(min_point);
-            cv::rectangle(result, rect, CV_RGB(255, 0, 0), 1);
-            for (int i = 0; i < rect.height; i++) {
-                for (int j = 0; j < rect.width; j++) {
-                    auto old_cropped = ctx.old_color_mat.at<cv::Vec3b>(i + rect.y, j + rect.x);
-                    auto new_cropped = ctx.new_color_mat.at<cv::Vec3b>(i + area.y, j + area.x);
-
-                    if (old_cropped != new_cropped) {
-                        result.at<cv::Vec3b>(i + rect.y, j + rect.x) = cv::Vec3b(0, 0, 255);
-                    }
+            std::vector<i32> pairs;
+            for (const i32 j : candidates[i]) {
+                const ImageSegment& image_segment2 = ctx.new_segments[j];
+                if (image_segment2.depth > depth || (image_segment1.depth < depth && image_segment2.depth < depth))
+                    continue;
+                if (new_descriptors.empty(j) || ctx.new_matched.test(j))
+                    continue;
+                pairs.push_back(j);
+            }
+
+            // the first candidate this segment wins is its match; the others
+            // may have been claimed by other old segments meanwhile
+            for (const i32 j : decisions.match(ctx, old_descriptors, i, new_descriptors, pairs)) {
+                if (ctx.new_matched.test(j))
+                    continue;
+                if (const auto rect = compare_segments(i, j)) {
+                    std::scoped_lock lock(clean_matches_mu);
+                    clean_matches.push_back({ i, j, *rect == image_segment1.area });
                 }
+                // only this task claims segment `i` at this depth
+                if (ctx.old_matched.test(i))
+                    break;
             }
-#ifdef ENABLE_PARALLEL
-        });
-    });
-#else
+        };
+        parallel_for(static_cast<i32>(0), static_cast<i32>(old_segments.size()), match_old);
+
+        for (const CleanMatch& m : clean_matches) {
+            mark_subtree_matched(ctx.new_segments, ctx.new_matched, m.new_index);
+            if (m.same_area)
+                mark_subtree_matched(old_segments, ctx.old_matched, m.old_index);
         }
     }
-#endif
-    Timer t2(ctx, "write");
-    cv::imwrite(ctx.arg.output_name + "_diff.png", result);
+}
 
-    auto draw_not_matched = [&](cv::Mat ret, const vector<ImageSegment>& segments) {
-#ifdef ENABLE_PARALLEL
-        tbb::parallel_for_each(segments, [&](const ImageSegment& image_segment) {
-#else
-        for (const auto& image_segment : segments) {
-#endif
-            if (image_segment.matched)
-                return;
+// returns the output image which could not be written, if any
+std::optional<std::string> write_diff_images(Context& ctx)
+{
+    Timer t(ctx, "write diff images");
+    std::optional<std::string> diff_error;
+    std::optional<std::string> delete_error;
+    std::optional<std::string> add_error;
+    auto write = [&](const std::string& path, const cv::Mat& image, std::optional<std::string>& error) {
+        if (!write_image(ctx, path, image))
+            error = "cannot write " + path;
+    };
+    write(output_path(ctx, "_diff"), ctx.diff_mat, diff_error);
 
-            cv::rectangle(ret, image_segment.area, CV_RGB(0, 255, 0), 2);
-#ifdef ENABLE_PARALLEL
-        });
-#else
+    // drawing is cheap, and cv::rectangle on a shared image is not thread-safe
+    auto draw_not_matched = [&](cv::Mat ret, const std::vector<ImageSegment>& segments, const MatchedSet& matched) {
+        for (i32 i = 0; i < static_cast<i32>(segments.size()); i++) {
+            if (!matched.test(i))
+                cv::rectangle(ret, segments[i].area, CV_RGB(0, 255, 0), 2);
         }
-#endif
     };
 
     if (ctx.arg.create_change_image) {
-        Timer t3(ctx, "create added and deleted image");
-#ifdef ENABLE_PARALLEL
-        tbb::task_group tg;
+        Timer t2(ctx, "create added and deleted image", &t);
+        TaskGroup tg;
         tg.run([&]() {
-#endif
-            const cv::Mat deleted = decode_from_mapped_file(*ctx.old_file, cv::IMREAD_COLOR);
-            draw_not_matched(deleted, ctx.old_segments);
-            cv::imwrite(ctx.arg.output_name + "_delete.png", deleted);
-#ifdef ENABLE_PARALLEL
+            // a copy: the pixels may be in a read-only mapping
+            const cv::Mat deleted = ctx.old_color_mat.clone();
+            draw_not_matched(deleted, *ctx.old_segments, ctx.old_matched);
+            write(output_path(ctx, "_delete"), deleted, delete_error);
         });
         tg.run([&]() {
-#endif
-            const cv::Mat added = decode_from_mapped_file(*ctx.new_file, cv::IMREAD_COLOR);
-            draw_not_matched(added, ctx.new_segments);
-            cv::imwrite(ctx.arg.output_name + "_add.png", added);
-#ifdef ENABLE_PARALLEL
+            const cv::Mat added = ctx.new_color_mat.clone();
+            draw_not_matched(added, ctx.new_segments, ctx.new_matched);
+            write(output_path(ctx, "_add"), added, add_error);
         });
         tg.wait();
-#endif
     }
+    return diff_error ? diff_error : delete_error ? delete_error : add_error;
 }
 
 } // namespace gazosan
@@ -0,0 +1,70 @@
+#include "gazosan.h"
+
+namespace gazosan {
+
+// An index holds everything detect_segments derives from an old image: the
+// decoded pixels, the segments and their descriptors, keyed by the options
+// they were computed with. Comparisons map it read-only and use the sections
+// in place, so that processes comparing against the same baseline share one
+// copy of it through the page cache.
+
+static SectionReader& open_old_index(Context& ctx)
+{
+    if (!ctx.old_index) {
+        ctx.old_index = SectionReader::open(ctx, ctx.arg.old_index, segment_options_key(ctx));
+        if (!ctx.old_index)
+            Fatal(ctx) << ctx.arg.old_index << ": not an index, or built with different options";
+    }
+    return *ctx.old_index;
+}
+
+// identifies the contents of the old image for the caches, without having the
+// image itself in -old_index mode
+u64 old_input_hash(Context& ctx)
+{
+    if (ctx.old_hash)
+        return *ctx.old_hash;
+
+    if (!ctx.arg.old_index.empty()) {
+        u64 hash = 0;
+        if (!open_old_index(ctx).get_value(section_tag("IXIH"), hash))
+            Fatal(ctx) << ctx.arg.old_index << ": damaged index";
+        ctx.old_hash = hash;
+    } else {
+        // opened by read_pair or load_image
+        ctx.old_hash = hash_bytes(ctx.old_file->data, ctx.old_file->size);
+    }
+    return *ctx.old_hash;
+}
+
+void build_index(Context& ctx)
+{
+    Timer t(ctx, "build index");
+    if (const std::optional<std::string> error = load_image(ctx))
+        Fatal(ctx) << *error;
+    if (ctx.old_color_mat.empty())
+        Fatal(ctx) << ctx.arg.old_file << ": cannot decode the image";
+    detect_segments(ctx);
+
+    Timer t2(ctx, "write index", &t);
+    // a raw frame may have padded rows
+    if (!ctx.old_color_mat.isContinuous())
+        ctx.old_color_mat = ctx.old_color_mat.clone();
+    SectionWriter writer;
+    writer.add_value(section_tag("IXIH"), old_input_hash(ctx));
+    write_pixels(writer, ctx.old_color_mat, ctx.old_gray_mat);
+    write_old_segments(ctx, writer);
+    if (!writer.write(ctx.arg.output_name, segment_options_key(ctx)))
+        Fatal(ctx) << "cannot write " << ctx.arg.output_name << ": " << errno_string();
+}
+
+void load_index(Context& ctx)
+{
+    Timer t(ctx, "load index");
+    const SectionReader& index = open_old_index(ctx);
+    if (!read_pixels(index, ctx.old_color_mat, ctx.old_gray_mat) || !read_old_segments(ctx, index, true))
+        Fatal(ctx) << ctx.arg.old_index << ": damaged index";
+    ctx.old_prepared = true;
+}
+
+} // namespace gazosan
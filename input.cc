@@ -0,0 +1,77 @@
+#include "gazosan.h"
+
+#include <charconv>
+
+namespace gazosan {
+
+static Counter num_raw_frames("raw_frames");
+
+// Besides file paths, inputs may be handed over by a producer on the same
+// host without a round trip through the disk:
+//
+//   fd:<N>      a file descriptor inherited from the parent, e.g. a memfd
+//   shm:<NAME>  a POSIX shared memory object
+//
+// Either may hold an encoded image or a raw frame. Returns -1 with errno set
+// like open(2).
+int open_input(const std::string& path)
+{
+    if (path.starts_with("fd:")) {
+        int fd = -1;
+        const char* end = path.data() + path.size();
+        if (std::from_chars(path.data() + 3, end, fd).ptr != end || fd < 0) {
+            errno = EBADF;
+            return -1;
+        }
+        // the caller closes what it gets; the inherited one stays open
+        return dup(fd);
+    }
+    if (path.starts_with("shm:"))
+        return shm_open(path.c_str() + 4, O_RDONLY, 0);
+    return ::open(path.c_str(), O_RDONLY);
+}
+
+// A raw frame is this header, then `height` rows of `stride` bytes each,
+// starting at `offset`. The pixels are 8 bits per channel, in BGR or BGRA
+// order.
+struct RawFrameHeader {
+    char magic[8]; // "GAZORAW\0"
+    u32 version;
+    u32 width;
+    u32 height;
+    u32 channels; // 3 or 4
+    u32 stride;
+    u32 offset; // of the first row from the start of the file
+};
+
+static constexpr char raw_frame_magic[8] = { 'G', 'A', 'Z', 'O', 'R', 'A', 'W', 0 };
+
+// Returns false if `file` is not a raw frame. A malformed one sets `error`.
+bool read_raw_frame(const MappedFile<Context>& file, cv::Mat& color, std::optional<std::string>& error)
+{
+    RawFrameHeader h {};
+    if (file.size < static_cast<i64>(sizeof(h)))
+        return false;
+    std::memcpy(&h, file.data, sizeof(h));
+    if (std::memcmp(h.magic, raw_frame_magic, sizeof(h.magic)) != 0)
+        return false;
+
+    if (h.version != 1 || h.width == 0 || h.height == 0 || (h.channels != 3 && h.channels != 4)
+        || h.stride < static_cast<u64>(h.width) * h.channels || h.offset < sizeof(h)
+        || h.offset + static_cast<u64>(h.height - 1) * h.stride + static_cast<u64>(h.width) * h.channels > static_cast<u64>(file.size)) {
+        error = file.name + ": malformed raw frame";
+        return true;
+    }
+
+    // BGR is used in place, like the pixel cache: read-only, but nothing
+    // draws into the input images
+    const cv::Mat frame(static_cast<int>(h.height), static_cast<int>(h.width), CV_8UC(h.channels), file.data + h.offset, h.stride);
+    if (h.channels == 3)
+        color = frame;
+    else
+        cv::cvtColor(frame, color, cv::COLOR_BGRA2BGR);
+    num_raw_frames++;
+    return true;
+}
+
+} // namespace gazosan
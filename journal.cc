@@ -0,0 +1,154 @@
+#include "gazosan.h"
+
+#include <filesystem>
+
+#include <sys/stat.h>
+
+namespace gazosan {
+
+// Bump when a change alters the output of a comparison.
+static constexpr u32 result_version = 1;
+
+static Counter num_result_cache_hits("result_cache_hits");
+
+// An output image as it was written, to notice when it was changed since.
+struct OutputRecord {
+    i64 size;
+    i64 mtime;
+};
+
+static std::vector<std::string> output_files(const Context& ctx)
+{
+    std::vector<std::string> files = { output_path(ctx, "_diff") };
+    if (ctx.arg.create_change_image) {
+        files.push_back(output_path(ctx, "_delete"));
+        files.push_back(output_path(ctx, "_add"));
+    }
+    return files;
+}
+
+static std::optional<OutputRecord> stat_output(const std::string& path)
+{
+    struct stat st {};
+    if (stat(path.c_str(), &st) != 0)
+        return std::nullopt;
+#if defined(__APPLE__)
+    return OutputRecord { st.st_size, static_cast<i64>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec };
+#else
+    return OutputRecord { st.st_size, static_cast<i64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec };
+#endif
+}
+
+// both inputs and every option that influences the outputs
+static u64 result_key(Context& ctx)
+{
+    u64 key = old_input_hash(ctx);
+    key = hash_bytes(ctx.new_file->data, ctx.new_file->size, key);
+    auto add = [&](const auto& value) { key = hash_bytes(&value, sizeof(value), key); };
+    add(result_version);
+    add(ctx.arg.bin_threshold);
+    add(ctx.arg.cross_check);
+    add(ctx.arg.features);
+    add(ctx.arg.max_keypoints);
+    add(ctx.arg.matcher);
+    add(ctx.arg.size_tolerance);
+    add(ctx.arg.aspect_tolerance);
+    add(ctx.arg.position_tolerance);
+    add(ctx.arg.hash_tolerance);
+    add(ctx.arg.create_change_image);
+    add(ctx.arg.output_format);
+    add(ctx.descriptor_tile_size);
+    return hash_bytes(CV_VERSION, std::strlen(CV_VERSION), key);
+}
+
+static bool link_or_copy(const std::string& from, const std::string& to)
+{
+    std::error_code ec;
+    if (std::filesystem::equivalent(from, to, ec))
+        return true;
+    std::filesystem::remove(to, ec);
+    if (link(from.c_str(), to.c_str()) == 0)
+        return true;
+    return std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+}
+
+// The result journal lives in -cache_dir: one entry per (old, new, options)
+// holding the diff model and where its output images were written. A pair
+// seen before gets those images linked or copied to its output names, so an
+// interrupted batch resumes where it stopped. Needs both inputs opened.
+bool reuse_result(Context& ctx)
+{
+    Timer t(ctx, "reuse result");
+    const u64 key = result_key(ctx);
+    const std::unique_ptr<SectionReader> reader = SectionReader::open(ctx, cache_path(ctx, key, ".res"), key);
+    std::vector<OutputRecord> records;
+    std::vector<char> names;
+    if (!reader || !reader->get(section_tag("RSOR"), records) || !reader->get(section_tag("RSON"), names))
+        return false;
+
+    std::vector<std::string> previous;
+    for (auto it = names.begin(); it != names.end();) {
+        const auto end = std::find(it, names.end(), '\0');
+        previous.emplace_back(it, end);
+        it = end == names.end() ? end : end + 1;
+    }
+
+    const std::vector<std::string> outputs = output_files(ctx);
+    if (previous.size() != outputs.size() || records.size() != outputs.size())
+        return false;
+
+    // the previous outputs must still be what was written back then
+    for (std::size_t i = 0; i < previous.size(); i++) {
+        const std::optional<OutputRecord> now = stat_output(previous[i]);
+        if (!now || now->size != records[i].size || now->mtime != records[i].mtime)
+            return false;
+    }
+    for (std::size_t i = 0; i < outputs.size(); i++) {
+        if (!link_or_copy(previous[i], outputs[i]))
+            return false;
+    }
+
+    reader->get(section_tag("RSCH"), ctx.changed_areas);
+    num_result_cache_hits++;
+    return true;
+}
+
+void record_result(Context& ctx)
+{
+    Timer t(ctx, "record result");
+
+    std::vector<cv::Rect> deleted;
+    for (i32 i = 0; i < static_cast<i32>(ctx.old_segments->size()); i++) {
+        if (!ctx.old_matched.test(i))
+            deleted.push_back((*ctx.old_segments)[i].area);
+    }
+    std::vector<cv::Rect> added;
+    for (i32 i = 0; i < static_cast<i32>(ctx.new_segments.size()); i++) {
+        if (!ctx.new_matched.test(i))
+            added.push_back(ctx.new_segments[i].area);
+    }
+
+    std::vector<OutputRecord> records;
+    std::vector<char> names;
+    for (const std::string& file : output_files(ctx)) {
+        std::error_code ec;
+        const std::string path = std::filesystem::absolute(file, ec).string();
+        const std::optional<OutputRecord> record = stat_output(path);
+        if (!record)
+            return;
+        records.push_back(*record);
+        names.insert(names.end(), path.begin(), path.end());
+        names.push_back('\0');
+    }
+
+    const u64 key = result_key(ctx);
+    SectionWriter writer;
+    writer.add(section_tag("RSCH"), ctx.changed_areas);
+    writer.add(section_tag("RSDL"), deleted);
+    writer.add(section_tag("RSAD"), added);
+    writer.add(section_tag("RSOR"), records);
+    writer.add(section_tag("RSON"), names);
+    writer.write(cache_path(ctx, key, ".res"), key);
+}
+
+} // namespace gazosan
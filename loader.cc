@@ -0,0 +1,194 @@
+#include "gazosan.h"
+
+#ifdef ENABLE_IO_URING
+#include <liburing.h>
+#endif
+
+namespace gazosan {
+
+#ifdef ENABLE_IO_URING
+
+static Counter num_loaded_files("loaded_files");
+static Counter num_loaded_bytes("loaded_bytes");
+
+static constexpr unsigned ring_entries = 64;
+static constexpr i64 max_read_size = 1 << 30;
+
+struct FileLoader::Ring {
+    io_uring ring;
+};
+
+struct FileLoader::Request {
+    int fd = -1;
+    ReadBuffer buffer;
+    i64 size = 0;
+    i64 mtime = 0;
+    i64 done = 0; // bytes read so far
+    bool finished = false;
+    bool failed = false;
+};
+
+std::unique_ptr<FileLoader> FileLoader::create(std::vector<std::string> paths, const i64 ahead)
+{
+    std::unique_ptr<FileLoader> loader(new FileLoader);
+    loader->ring = std::make_unique<Ring>();
+    // seccomp profiles of container runtimes often block io_uring
+    if (io_uring_queue_init(ring_entries, &loader->ring->ring, 0) < 0) {
+        loader->ring.reset();
+        return nullptr;
+    }
+    loader->requests.resize(paths.size());
+    loader->paths = std::move(paths);
+    loader->ahead = std::max<i64>(1, ahead);
+    return loader;
+}
+
+FileLoader::~FileLoader()
+{
+    if (!ring)
+        return;
+    // the kernel may still be writing into the buffers
+    while (in_flight > 0)
+        complete_one();
+    for (Request& req : requests) {
+        if (req.fd != -1)
+            close(req.fd);
+    }
+    io_uring_queue_exit(&ring->ring);
+}
+
+static void queue_read(io_uring& ring, const int fd, u8* buf, const i64 size, const i64 offset, void* data)
+{
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    io_uring_prep_read(sqe, fd, buf, static_cast<unsigned>(std::min(size, max_read_size)), static_cast<u64>(offset));
+    io_uring_sqe_set_data(sqe, data);
+}
+
+// Opens the files up to `ahead` beyond the last one taken and queues their
+// reads. Opening is synchronous, but happens here rather than on the threads
+// which decode.
+void FileLoader::submit()
+{
+    bool queued = false;
+    while (next < paths.size() && static_cast<i64>(next) < static_cast<i64>(taken) + ahead && in_flight < static_cast<i64>(ring_entries)) {
+        Request& req = requests[next];
+        const std::string& path = paths[next++];
+
+        req.fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st {};
+        if (req.fd == -1 || fstat(req.fd, &st) == -1) {
+            req.failed = req.finished = true;
+            continue;
+        }
+        req.size = st.st_size;
+        req.mtime = static_cast<i64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        if (req.size == 0) {
+            req.finished = true;
+            continue;
+        }
+
+        {
+            std::scoped_lock lock(free_mu);
+            if (!free_buffers.empty()) {
+                req.buffer = std::move(free_buffers.back());
+                free_buffers.pop_back();
+            }
+        }
+        req.buffer.reserve(req.size);
+
+        queue_read(ring->ring, req.fd, req.buffer.data.get(), req.size, 0, &req);
+        in_flight++;
+        queued = true;
+    }
+    if (queued)
+        io_uring_submit(&ring->ring);
+}
+
+void FileLoader::complete_one()
+{
+    io_uring_cqe* cqe = nullptr;
+    if (io_uring_wait_cqe(&ring->ring, &cqe) < 0)
+        return;
+    Request& req = *static_cast<Request*>(io_uring_cqe_get_data(cqe));
+    const i32 res = cqe->res;
+    io_uring_cqe_seen(&ring->ring, cqe);
+    in_flight--;
+
+    if (res == -EINTR || res == -EAGAIN || (res > 0 && req.done + res < req.size)) {
+        // a short read, or one to try again: queue the rest
+        req.done += std::max(0, res);
+        queue_read(ring->ring, req.fd, req.buffer.data.get() + req.done, req.size - req.done, req.done, &req);
+        in_flight++;
+        io_uring_submit(&ring->ring);
+        return;
+    }
+
+    if (res < 0)
+        req.failed = true;
+    else
+        req.done += res;
+    // a file which shrank since fstat ends early
+    req.size = req.done;
+    req.finished = true;
+    close(req.fd);
+    req.fd = -1;
+}
+
+MappedFile<Context>* FileLoader::take(const std::size_t i)
+{
+    taken = std::max(taken, i + 1);
+    submit();
+    while (!requests[i].finished) {
+        complete_one();
+        submit();
+    }
+
+    Request& req = requests[i];
+    if (req.failed)
+        return nullptr;
+
+    num_loaded_files++;
+    num_loaded_bytes += req.size;
+    auto* file = new MappedFile<Context>;
+    file->name = paths[i];
+    file->size = req.size;
+    file->mtime = req.mtime;
+    file->in_memory = true;
+    file->buffer = std::move(req.buffer);
+    file->data = file->size > 0 ? file->buffer.data.get() : nullptr;
+    return file;
+}
+
+void FileLoader::recycle(MappedFile<Context>& file)
+{
+    if (!file.in_memory)
+        return;
+    std::scoped_lock lock(free_mu);
+    if (static_cast<i64>(free_buffers.size()) < ahead)
+        free_buffers.push_back(std::move(file.buffer));
+    file.data = nullptr;
+    file.size = 0;
+}
+
+#else
+
+struct FileLoader::Ring { };
+struct FileLoader::Request { };
+
+std::unique_ptr<FileLoader> FileLoader::create(std::vector<std::string>, i64)
+{
+    return nullptr;
+}
+
+FileLoader::~FileLoader() = default;
+
+MappedFile<Context>* FileLoader::take(std::size_t)
+{
+    return nullptr;
+}
+
+void FileLoader::recycle(MappedFile<Context>&) { }
+
+#endif
+
+} // namespace gazosan
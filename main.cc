@@ -6,53 +6,48 @@
 
 using namespace gazosan;
 
-namespace gazosan {
-
-std::size_t get_default_thread_count()
-{
-    constexpr std::size_t default_thread = 16;
-#ifdef ENABLE_PARALLEL
-    const std::size_t n = tbb::global_control::active_value(tbb::global_control::max_allowed_parallelism);
-#else
-    constexpr std::size_t n = 16;
-#endif
-    return std::min(n, default_thread);
-}
-
-} // namespace gazosan
-
 int main(const int argc, char** argv)
 {
     Context ctx;
     const Timer t_all(ctx, "all");
     for (int i = 0; i < argc; i++)
         ctx.cmdline_args.emplace_back(argv[i]);
+    ctx.limits = detect_system_limits();
     parse_args(ctx);
-
-#ifdef ENABLE_PARALLEL
-    tbb::global_control tbb_cont(tbb::global_control::max_allowed_parallelism, ctx.arg.thread_count);
-#endif
-
-    load_image(ctx);
-
-    const std::variant<bool, std::string> diff_check = check_histogram_differential(ctx);
-    if (!std::holds_alternative<bool>(diff_check)) {
-        const std::string err = std::get<std::string>(diff_check);
-        Fatal(ctx) << err;
+    Counter::enabled = ctx.arg.perf;
+    ctx.features = std::make_unique<FeatureBackendPool>(ctx.arg.features, ctx.arg.max_keypoints);
+    init_parallelism(ctx);
+
+    auto print_perf = [&] {
+        t_all.stop();
+        if (ctx.arg.perf) {
+            print_timer_records(ctx.timer_records);
+            Counter::print();
+            print_system_limits(ctx);
+        }
+    };
+
+    if (ctx.arg.build_index) {
+        build_index(ctx);
+        print_perf();
+        return 0;
     }
 
-    if (std::get<bool>(diff_check)) {
-        Fatal(ctx) << "two images are same";
+    if (!ctx.arg.old_dir.empty()) {
+        const bool ok = compare_directories(ctx);
+        print_perf();
+        return ok ? 0 : 1;
     }
 
-    detect_segments(ctx);
-    // save_segments(ctx);
-
-    create_diff_image(ctx);
+    if (ctx.arg.new_files.size() > 1) {
+        const bool ok = compare_candidates(ctx);
+        print_perf();
+        return ok ? 0 : 1;
+    }
 
-    t_all.stop();
-    if (ctx.arg.perf)
-        print_timer_records(ctx.timer_records);
+    if (const std::optional<std::string> err = compare_images(ctx))
+        Fatal(ctx) << *err;
 
+    print_perf();
     return 0;
 }
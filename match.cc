@@ -0,0 +1,348 @@
+#include "gazosan.h"
+
+#include <cmath>
+
+namespace gazosan {
+
+static Counter num_distance_tiles("distance_tiles");
+static Counter num_deduplicated_pairs("deduplicated_pairs");
+
+DescriptorStore::DescriptorStore(const Context& ctx, const std::vector<ImageSegment>& segments, const std::vector<cv::Mat>& descriptors)
+{
+    const auto n = static_cast<i32>(segments.size());
+    offsets.assign(n, 0);
+    counts.assign(n, 0);
+
+    int depth = CV_8U;
+    for (i32 i = 0; i < n; i++) {
+        if (segments[i].duplicate_of >= 0 || descriptors[i].empty())
+            continue;
+        offsets[i] = rows;
+        counts[i] = descriptors[i].rows;
+        rows += counts[i];
+        cols = descriptors[i].cols;
+        depth = descriptors[i].depth();
+    }
+    // duplicates are stored once, through their representative
+    for (i32 i = 0; i < n; i++) {
+        if (segments[i].duplicate_of >= 0) {
+            offsets[i] = offsets[segments[i].duplicate_of];
+            counts[i] = counts[segments[i].duplicate_of];
+        }
+    }
+
+    if (rows == 0)
+        return;
+    if (depth != CV_8U)
+        Fatal(ctx) << "the feature backend returned non-binary descriptors";
+
+    stride = (cols + 7) / 8 * 8;
+    data.assign(static_cast<std::size_t>(rows) * stride / 8, 0);
+    bits = data.data();
+
+    for (i32 i = 0; i < n; i++) {
+        if (counts[i] == 0 || segments[i].duplicate_of >= 0)
+            continue;
+        for (i32 r = 0; r < counts[i]; r++)
+            std::memcpy(const_cast<u8*>(row(offsets[i] + r)), descriptors[i].ptr<u8>(r), cols);
+    }
+
+    if (ctx.arg.matcher == MatcherType::HAMMING)
+        return;
+
+    // the L2 matchers compare rows by their norms and dot products
+    norms.resize(rows);
+    for (i32 r = 0; r < rows; r++) {
+        const u8* p = row(r);
+        double sum = 0;
+        for (i32 c = 0; c < cols; c++)
+            sum += static_cast<double>(p[c]) * p[c];
+        norms[r] = sum;
+    }
+}
+
+void DescriptorStore::convert_rows(const i32 begin, const i32 end, const int type, cv::Mat& out) const
+{
+    out.create(end - begin, cols, type);
+    for (i32 r = begin; r < end; r++) {
+        const u8* src = row(r);
+        auto convert = [&]<typename T>(T* dst) {
+            for (i32 c = 0; c < cols; c++)
+                dst[c] = static_cast<T>(src[c]);
+        };
+        if (type == CV_64F)
+            convert(out.ptr<double>(r - begin));
+        else
+            convert(out.ptr<float>(r - begin));
+    }
+}
+
+struct StoreLayout {
+    i32 cols;
+    i32 stride;
+};
+
+void DescriptorStore::write_to(SectionWriter& writer) const
+{
+    writer.add_value(section_tag("DSLY"), StoreLayout { cols, stride });
+    writer.add(section_tag("DSDT"), bits, static_cast<std::size_t>(rows) * stride);
+    writer.add(section_tag("DSNM"), norms);
+    writer.add(section_tag("DSOF"), offsets);
+    writer.add(section_tag("DSCT"), counts);
+}
+
+bool DescriptorStore::read_from(const SectionReader& reader, const bool in_place)
+{
+    StoreLayout layout {};
+    const std::optional<std::string_view> rows_section = reader.get(section_tag("DSDT"));
+    if (!reader.get_value(section_tag("DSLY"), layout) || !rows_section || !reader.get(section_tag("DSNM"), norms)
+        || !reader.get(section_tag("DSOF"), offsets) || !reader.get(section_tag("DSCT"), counts))
+        return false;
+    cols = layout.cols;
+    stride = layout.stride;
+
+    // a damaged file must not send the matchers out of bounds
+    if (cols < 0 || stride < cols || stride % 8 != 0)
+        return false;
+    // stores without any rows have no stride
+    if (stride == 0 ? !rows_section->empty() : rows_section->size() % stride != 0)
+        return false;
+    // Hamming stores keep no norms, so the rows are counted in the data
+    rows = stride == 0 ? 0 : static_cast<i32>(rows_section->size() / stride);
+    if ((!norms.empty() && static_cast<i64>(norms.size()) != rows) || offsets.size() != counts.size())
+        return false;
+
+    // sections are page-aligned
+    if (in_place) {
+        data.clear();
+        bits = reinterpret_cast<const u64*>(rows_section->data());
+    } else {
+        data.resize(rows_section->size() / 8);
+        std::memcpy(data.data(), rows_section->data(), rows_section->size());
+        bits = data.data();
+    }
+
+    for (std::size_t i = 0; i < offsets.size(); i++) {
+        if (offsets[i] < 0 || counts[i] < 0 || offsets[i] + static_cast<i64>(counts[i]) > rows)
+            return false;
+    }
+    return true;
+}
+
+DescriptorStore DescriptorStore::view() const
+{
+    DescriptorStore store;
+    store.cols = cols;
+    store.stride = stride;
+    store.rows = rows;
+    store.bits = bits;
+    store.norms = norms;
+    store.offsets = offsets;
+    store.counts = counts;
+    return store;
+}
+
+// Nearest neighbours in both directions between one query segment and a
+// train segment. L2 distances are kept squared until the final reduction.
+struct NearestPair {
+    std::vector<double> dist12;
+    std::vector<i32> idx12;
+    std::vector<double> dist21;
+    std::vector<i32> idx21;
+
+    void update(const i32 r, const i32 c, const double d)
+    {
+        if (d < dist12[r]) {
+            dist12[r] = d;
+            idx12[r] = c;
+        }
+        if (d < dist21[c]) {
+            dist21[c] = d;
+            idx21[c] = r;
+        }
+    }
+};
+
+static void nearest_l2(const DescriptorStore& query, const i32 query_segment, const DescriptorStore& train, const std::vector<i32>& train_segments, std::vector<NearestPair>& nearest)
+{
+    // rows of a tile side; 256x256 doubles stay within L2 cache
+    constexpr i32 tile_rows = 256;
+    // train segments closer than this are computed in the same tile
+    constexpr i32 max_gap = 64;
+
+    const i32 query_begin = query.offsets[query_segment];
+    const i32 query_rows = query.rows_of(query_segment);
+
+    // Stored rows are converted to double tile by tile. Byte descriptors are
+    // exact in double precision, so the |a|^2 + |b|^2 - 2a.b identity loses
+    // nothing compared to a direct L2 computation.
+    cv::Mat a, b, products;
+    for (i32 q0 = 0; q0 < query_rows; q0 += tile_rows) {
+        const i32 q1 = std::min(q0 + tile_rows, query_rows);
+        query.convert_rows(query_begin + q0, query_begin + q1, CV_64F, a);
+
+        // group train segments into runs of nearby rows
+        for (std::size_t first = 0; first < train_segments.size();) {
+            const i32 run_begin = train.offsets[train_segments[first]];
+            i32 run_end = run_begin + train.rows_of(train_segments[first]);
+            std::size_t last = first;
+            while (last + 1 < train_segments.size()) {
+                const i32 next = train_segments[last + 1];
+                const i32 next_begin = train.offsets[next];
+                const i32 next_end = next_begin + train.rows_of(next);
+                if (next_begin < run_end || next_begin - run_end > max_gap || next_end - run_begin > tile_rows)
+                    break;
+                run_end = next_end;
+                last++;
+            }
+
+            if (run_end > run_begin) {
+                num_distance_tiles++;
+                train.convert_rows(run_begin, run_end, CV_64F, b);
+                // products = -2 a.b^T
+                cv::gemm(a, b, -2.0, cv::noArray(), 0, products, cv::GEMM_2_T);
+
+                for (std::size_t k = first; k <= last; k++) {
+                    const i32 t_begin = train.offsets[train_segments[k]];
+                    const i32 t_end = t_begin + train.rows_of(train_segments[k]);
+
+                    for (i32 r = q0; r < q1; r++) {
+                        const double* row = products.ptr<double>(r - q0);
+                        const double an = query.norms[query_begin + r];
+                        for (i32 c = t_begin; c < t_end; c++)
+                            nearest[k].update(r, c - t_begin, an + train.norms[c] + row[c - run_begin]);
+                    }
+                }
+            }
+            first = last + 1;
+        }
+    }
+}
+
+static void nearest_hamming(const DescriptorStore& query, const i32 query_segment, const DescriptorStore& train, const std::vector<i32>& train_segments, std::vector<NearestPair>& nearest)
+{
+    const i32 query_begin = query.offsets[query_segment];
+    const i32 query_rows = query.rows_of(query_segment);
+
+    std::vector<u32> distances;
+    for (std::size_t k = 0; k < train_segments.size(); k++) {
+        const i32 t_begin = train.offsets[train_segments[k]];
+        const i32 t_rows = train.rows_of(train_segments[k]);
+        distances.resize(t_rows);
+
+        for (i32 r = 0; r < query_rows; r++) {
+            hamming_distances(query.row_bits(query_begin + r), train.row_bits(t_begin), t_rows, train.words(), distances.data());
+            for (i32 c = 0; c < t_rows; c++)
+                nearest[k].update(r, c, distances[c]);
+        }
+    }
+}
+
+std::vector<i32> batch_descriptor_match(const Context& ctx, const DescriptorStore& query, const i32 query_segment, const DescriptorStore& train, const std::vector<i32>& train_segments)
+{
+    const i32 query_rows = query.rows_of(query_segment);
+    if (query_rows == 0)
+        return {};
+
+    const bool hamming = ctx.arg.matcher == MatcherType::HAMMING;
+    if (query.cols != train.cols || (hamming && query.words() != train.words()))
+        return {};
+
+    std::vector<i32> matched;
+    if (ctx.arg.matcher == MatcherType::FLANN) {
+        cv::Mat descriptor1, descriptor2;
+        const i32 query_begin = query.offsets[query_segment];
+        query.convert_rows(query_begin, query_begin + query_rows, CV_32F, descriptor1);
+        for (const i32 segment : train_segments) {
+            if (train.empty(segment))
+                continue;
+            train.convert_rows(train.offsets[segment], train.offsets[segment] + train.rows_of(segment), CV_32F, descriptor2);
+            if (descriptor_match(ctx, descriptor1, descriptor2))
+                matched.push_back(segment);
+        }
+        return matched;
+    }
+
+    std::vector<NearestPair> nearest(train_segments.size());
+    for (std::size_t k = 0; k < train_segments.size(); k++) {
+        const i32 rows = train.rows_of(train_segments[k]);
+        nearest[k].dist12.assign(query_rows, DBL_MAX);
+        nearest[k].idx12.assign(query_rows, -1);
+        nearest[k].dist21.assign(rows, DBL_MAX);
+        nearest[k].idx21.assign(rows, -1);
+    }
+
+    if (hamming)
+        nearest_hamming(query, query_segment, train, train_segments, nearest);
+    else
+        nearest_l2(query, query_segment, train, train_segments, nearest);
+
+    std::vector<cv::DMatch> match12, match21;
+    for (std::size_t k = 0; k < train_segments.size(); k++) {
+        const NearestPair& np = nearest[k];
+        if (np.dist21.empty())
+            continue;
+
+        auto to_match = [&](const i32 query_idx, const i32 train_idx, const double d) {
+            cv::DMatch m;
+            m.queryIdx = query_idx;
+            m.trainIdx = train_idx;
+            m.distance = static_cast<float>(hamming ? d : std::sqrt(std::max(d, 0.0)));
+            return m;
+        };
+
+        match12.clear();
+        match21.clear();
+        for (i32 r = 0; r < query_rows; r++)
+            match12.push_back(to_match(r, np.idx12[r], np.dist12[r]));
+        for (i32 c = 0; c < static_cast<i32>(np.dist21.size()); c++)
+            match21.push_back(to_match(c, np.idx21[c], np.dist21[c]));
+
+        if (is_descriptor_match(ctx, match12, match21))
+            matched.push_back(train_segments[k]);
+    }
+    return matched;
+}
+
+std::vector<i32> MatchDecisionCache::match(const Context& ctx, const DescriptorStore& query, const i32 query_segment, const DescriptorStore& train, const std::vector<i32>& candidates)
+{
+    auto representative = [](const std::vector<ImageSegment>& segments, const i32 i) {
+        return segments[i].duplicate_of >= 0 ? segments[i].duplicate_of : i;
+    };
+    auto key = [](const i32 q, const i32 t) {
+        return (static_cast<u64>(static_cast<u32>(q)) << 32) | static_cast<u32>(t);
+    };
+
+    const i32 q = representative(query_segments, query_segment);
+
+    // decide each distinct (query, train) content pair once
+    std::vector<i32> undecided;
+    {
+        std::scoped_lock lock(mu);
+        for (const i32 j : candidates) {
+            const i32 t = representative(train_segments, j);
+            if (decisions.contains(key(q, t)))
+                num_deduplicated_pairs++;
+            else
+                undecided.push_back(t);
+        }
+    }
+    std::ranges::sort(undecided);
+    const auto [first, last] = std::ranges::unique(undecided);
+    num_deduplicated_pairs += static_cast<i64>(last - first);
+    undecided.erase(first, last);
+
+    const std::vector<i32> matched = batch_descriptor_match(ctx, query, q, train, undecided);
+
+    std::vector<i32> result;
+    std::scoped_lock lock(mu);
+    for (const i32 t : undecided)
+        decisions.emplace(key(q, t), std::ranges::binary_search(matched, t));
+    for (const i32 j : candidates) {
+        if (decisions[key(q, representative(train_segments, j))])
+            result.push_back(j);
+    }
+    return result;
+}
+
+} // namespace gazosan
@@ -0,0 +1,227 @@
+#include "gazosan.h"
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <utility>
+
+#include <sched.h>
+#include <unistd.h>
+
+#if __has_include(<opencv2/core/parallel/parallel_backend.hpp>)
+#include <opencv2/core/parallel/parallel_backend.hpp>
+#define HAVE_CV_PARALLEL_BACKEND
+#endif
+
+namespace gazosan {
+
+// the first line of a cgroup or proc file, or "" if it does not exist
+static std::string read_line(const std::string& path)
+{
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+// Directories which may hold the limits of this process for a cgroup v1
+// controller, or for cgroup v2 if `controller` is empty. The path in
+// /proc/self/cgroup is "/" inside a container with a cgroup namespace of its
+// own, where the limits are at the mount point itself.
+static std::vector<std::string> cgroup_dirs(const std::string& controller, const std::vector<std::string>& mounts)
+{
+    std::string path = "/";
+    std::ifstream in("/proc/self/cgroup");
+    for (std::string line; std::getline(in, line);) {
+        // "<id>:<controllers>:<path>"
+        const std::size_t a = line.find(':');
+        const std::size_t b = line.find(':', a + 1);
+        if (a == std::string::npos || b == std::string::npos)
+            continue;
+        if (("," + line.substr(a + 1, b - a - 1) + ",").find("," + controller + ",") != std::string::npos)
+            path = line.substr(b + 1);
+    }
+
+    std::vector<std::string> dirs;
+    for (const std::string& mount : mounts) {
+        if (path != "/")
+            dirs.push_back(mount + path);
+        dirs.push_back(mount);
+    }
+    return dirs;
+}
+
+// cgroup v2 has "<quota> <period>" or "max <period>" in cpu.max, v1 has the
+// two values in separate files with a quota of -1 for no limit
+static double cgroup_cpus()
+{
+    for (const std::string& dir : cgroup_dirs("", { "/sys/fs/cgroup" })) {
+        std::istringstream in(read_line(dir + "/cpu.max"));
+        std::string quota;
+        double period = 0;
+        if (in >> quota >> period)
+            return quota == "max" || period <= 0 ? 0 : std::stod(quota) / period;
+    }
+
+    for (const std::string& dir : cgroup_dirs("cpu", { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" })) {
+        const std::string quota = read_line(dir + "/cpu.cfs_quota_us");
+        const std::string period = read_line(dir + "/cpu.cfs_period_us");
+        if (!quota.empty() && !period.empty())
+            return std::stod(quota) <= 0 || std::stod(period) <= 0 ? 0 : std::stod(quota) / std::stod(period);
+    }
+    return 0;
+}
+
+static i64 cgroup_memory()
+{
+    for (const std::string& dir : cgroup_dirs("", { "/sys/fs/cgroup" })) {
+        const std::string max = read_line(dir + "/memory.max");
+        if (!max.empty())
+            return max == "max" ? 0 : std::stoll(max);
+    }
+
+    // v1 reports "no limit" as a huge number, which SystemLimits::memory
+    // clamps to the physical memory
+    for (const std::string& dir : cgroup_dirs("memory", { "/sys/fs/cgroup/memory" })) {
+        const std::string limit = read_line(dir + "/memory.limit_in_bytes");
+        if (!limit.empty())
+            return std::stoll(limit);
+    }
+    return 0;
+}
+
+SystemLimits detect_system_limits()
+{
+    SystemLimits limits;
+    limits.online_cpus = std::max<i64>(1, sysconf(_SC_NPROCESSORS_ONLN));
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        limits.affinity_cpus = CPU_COUNT(&set);
+
+    limits.cgroup_cpus = cgroup_cpus();
+    limits.physical_memory = static_cast<i64>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+    limits.cgroup_memory = cgroup_memory();
+    return limits;
+}
+
+i64 SystemLimits::cpus() const
+{
+    i64 n = affinity_cpus > 0 ? affinity_cpus : online_cpus;
+    if (cgroup_cpus > 0)
+        n = std::min(n, static_cast<i64>(cgroup_cpus));
+    return std::max<i64>(1, n);
+}
+
+i64 SystemLimits::memory() const
+{
+    if (cgroup_memory > 0 && physical_memory > 0)
+        return std::min(cgroup_memory, physical_memory);
+    return std::max(cgroup_memory, physical_memory);
+}
+
+std::size_t get_default_thread_count(const SystemLimits& limits)
+{
+    return static_cast<std::size_t>(limits.cpus());
+}
+
+i64 get_default_memory_budget(const SystemLimits& limits)
+{
+    // leave room for the decoded images and the rest of the process
+    return limits.memory() / 2;
+}
+
+#ifdef HAVE_CV_PARALLEL_BACKEND
+// Runs the parallel loops of OpenCV as tasks of our own scheduler, so that
+// they share the -thread_count budget with the rest of the work instead of
+// starting a thread pool of their own.
+class SharedParallelFor final : public cv::parallel::ParallelForAPI {
+public:
+    explicit SharedParallelFor(const int threads)
+        : threads(threads)
+    {
+    }
+
+    void parallel_for(const int tasks, const FN_parallel_for_body_cb_t body, void* data) override
+    {
+        gazosan::parallel_for(0, tasks, [&](const int i) { body(i, i + 1, data); });
+    }
+
+    [[nodiscard]] int getThreadNum() const override
+    {
+        return current_thread_index();
+    }
+
+    [[nodiscard]] int getNumThreads() const override
+    {
+        return threads;
+    }
+
+    // the actual limit is set by init_parallelism
+    int setNumThreads(const int n) override
+    {
+        return std::exchange(threads, n);
+    }
+
+    [[nodiscard]] const char* getName() const override
+    {
+        return "gazosan";
+    }
+
+private:
+    int threads;
+};
+#endif
+
+void init_parallelism(Context& ctx)
+{
+    const int threads = static_cast<int>(ctx.arg.thread_count);
+
+#ifdef ENABLE_PARALLEL
+    ctx.parallelism = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, threads);
+
+    // both arenas may use every thread; TBB hands the workers to whichever
+    // side is busier, and all of them to the other one once a side is done
+    if (ctx.arg.side_arenas) {
+        ctx.old_arena = std::make_unique<tbb::task_arena>(threads);
+        ctx.new_arena = std::make_unique<tbb::task_arena>(threads);
+    }
+#else
+    ThreadPool::instance().start(threads);
+#endif
+
+#ifdef HAVE_CV_PARALLEL_BACKEND
+    cv::parallel::setParallelForBackend(std::make_shared<SharedParallelFor>(threads));
+#endif
+
+    // without a pluggable backend, at least keep OpenCV's own pool in budget
+    cv::setNumThreads(threads);
+
+    // The tile size changes the descriptors, so it is only derived from the
+    // host on request. Every thread may be working on a tile at the same time.
+    ctx.descriptor_tile_size = ctx.arg.descriptor_tile_size;
+    if (ctx.descriptor_tile_size == 0) {
+        constexpr i64 bytes_per_pixel = 160; // rough peak of AKAZE's scale space
+        const i64 side = static_cast<i64>(std::sqrt(ctx.arg.memory_budget / threads / bytes_per_pixel));
+        ctx.descriptor_tile_size = static_cast<i32>(std::clamp<i64>(side, 128, 512));
+    }
+}
+
+void print_system_limits(const Context& ctx)
+{
+    auto print = [](const std::string& name, const auto value) {
+        std::cout << std::setw(20) << std::right << name << "=" << value << "\n";
+    };
+    print("online_cpus", ctx.limits.online_cpus);
+    print("affinity_cpus", ctx.limits.affinity_cpus);
+    print("cgroup_cpus", ctx.limits.cgroup_cpus);
+    print("physical_memory", ctx.limits.physical_memory);
+    print("cgroup_memory", ctx.limits.cgroup_memory);
+    print("thread_count", ctx.arg.thread_count);
+    print("memory_budget", ctx.arg.memory_budget);
+    print("tile_size", ctx.descriptor_tile_size);
+    std::cout << std::flush;
+}
+
+} // namespace gazosan
@@ -1,10 +1,12 @@
 #include "gazosan.h"
 
+#include <iomanip>
+
 #include <sys/resource.h>
 #include <sys/time.h>
 
 namespace gazosan {
-static i64 now_nsec()
+i64 now_nsec()
 {
     timespec t {};
     clock_gettime(CLOCK_MONOTONIC, &t);
@@ -28,8 +30,15 @@ TimerRecord::TimerRecord(std::string name, TimerRecord* parent)
 {
     start = now_nsec();
     std::tie(user, sys) = get_usage();
-    if (parent)
-        parent->children.push_back(this);
+}
+
+TimerRecord::TimerRecord(std::string name, TimerRecord* parent, const i64 start, const i64 end)
+    : name(std::move(name))
+    , parent(parent)
+    , start(start)
+    , end(end)
+    , stopped(true)
+{
 }
 
 void TimerRecord::stop()
@@ -45,6 +54,13 @@ void TimerRecord::stop()
     sys = sys2 - sys;
 }
 
+void Counter::print()
+{
+    for (const Counter* c : instances)
+        std::cout << std::setw(20) << std::right << c->name << "=" << c->value.load() << "\n";
+    std::cout << std::flush;
+}
+
 static void print_rec(TimerRecord& rec, const i64 indent) // NOLINT(*-no-recursion)
 {
     printf(" %8.3f %8.3f %8.3f  %s%s\n",
@@ -62,15 +78,34 @@ static void print_rec(TimerRecord& rec, const i64 indent) // NOLINT(*-no-recursi
         print_rec(*child, indent + 1);
 }
 
-void print_timer_records(vector<std::unique_ptr<TimerRecord>>& records)
+std::vector<TimerRecord*> TimerRecords::merge()
 {
-    for (const auto& rec : records)
+    std::vector<TimerRecord*> records;
+    buffers.for_each([&](const std::vector<std::unique_ptr<TimerRecord>>& buffer) {
+        for (const auto& rec : buffer)
+            records.push_back(rec.get());
+    });
+
+    // an outer timer starts before its inner timers, and is created before
+    // them if they start within the same nanosecond
+    std::ranges::stable_sort(records, [](const TimerRecord* a, const TimerRecord* b) {
+        return a->start < b->start;
+    });
+    return records;
+}
+
+void print_timer_records(TimerRecords& timer_records)
+{
+    const std::vector<TimerRecord*> records = timer_records.merge();
+    for (TimerRecord* rec : records)
         rec->stop();
 
     for (i64 i = 0; i < records.size(); i++) {
         TimerRecord& inner = *records[i];
-        if (inner.parent)
+        if (inner.parent) {
+            inner.parent->children.push_back(&inner);
             continue;
+        }
 
         for (i64 j = i - 1; j >= 0; j--) {
             TimerRecord& outer = *records[j];
@@ -84,7 +119,7 @@ void print_timer_records(vector<std::unique_ptr<TimerRecord>>& records)
 
     std::cout << "     User   System     Real  Name\n";
 
-    for (std::unique_ptr<TimerRecord>& rec : records)
+    for (TimerRecord* rec : records)
         if (!rec->parent)
             print_rec(*rec, 0);
 
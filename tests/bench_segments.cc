@@ -0,0 +1,138 @@
+#include "gazosan.h"
+
+#include <bit>
+#include <chrono>
+#include <iomanip>
+#include <random>
+
+#include <tbb/concurrent_vector.h>
+
+// Compares the segment arrays as they were, tbb::concurrent_vector filled by
+// concurrent push_back, with the reserved std::vector filled in order that
+// replaced them. Iteration follows the access pattern of matching: every
+// new segment scans the old ones, and candidate lists index into them.
+//
+// usage: bench_segments [segments] [rounds]
+
+using namespace gazosan;
+
+template <typename F>
+static double seconds(const i32 rounds, F&& fn)
+{
+    double best = 0;
+    for (i32 i = 0; i < rounds; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || s < best)
+            best = s;
+    }
+    return best;
+}
+
+static std::vector<cv::Rect> random_areas(const i32 n, const u32 seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<i32> pos(0, 4000);
+    std::uniform_int_distribution<i32> len(1, 200);
+    std::vector<cv::Rect> areas;
+    for (i32 i = 0; i < n; i++)
+        areas.emplace_back(pos(rng), pos(rng), len(rng), len(rng));
+    return areas;
+}
+
+static ImageSegment make_segment(const cv::Rect& area, const i32 i)
+{
+    ImageSegment segment(area, cv::Mat());
+    segment.hash = static_cast<u64>(i) * 0x9e3779b97f4a7c15ULL;
+    return segment;
+}
+
+// the plausibility test of CandidateIndex, roughly
+template <typename Segments>
+static i64 scan(const Segments& old_segments, const Segments& new_segments, const MatchedSet& old_matched)
+{
+    i64 hits = 0;
+    for (const ImageSegment& n : new_segments) {
+        for (i32 i = 0; i < static_cast<i32>(old_segments.size()); i++) {
+            const ImageSegment& o = old_segments[i];
+            if (old_matched.test(i) || std::abs(o.area.width - n.area.width) > 8 || std::abs(o.area.height - n.area.height) > 8)
+                continue;
+            hits += std::popcount(o.hash ^ n.hash) <= 20;
+        }
+    }
+    return hits;
+}
+
+template <typename Segments>
+static i64 lookup(const Segments& segments, const std::vector<i32>& candidates)
+{
+    i64 sum = 0;
+    for (const i32 idx : candidates)
+        sum += segments[idx].area.width + static_cast<i64>(segments[idx].hash & 1);
+    return sum;
+}
+
+int main(const int argc, char** argv)
+{
+    const i32 n = argc > 1 ? std::stoi(argv[1]) : 4000;
+    const i32 rounds = argc > 2 ? std::stoi(argv[2]) : 5;
+    const std::vector<cv::Rect> old_areas = random_areas(n, 1);
+    const std::vector<cv::Rect> new_areas = random_areas(n, 2);
+
+    std::mt19937 rng(3);
+    std::uniform_int_distribution<i32> pick(0, n - 1);
+    std::vector<i32> candidates(static_cast<std::size_t>(n) * 256);
+    for (i32& idx : candidates)
+        idx = pick(rng);
+
+    tbb::concurrent_vector<ImageSegment> cv_old, cv_new;
+    std::vector<ImageSegment> std_old, std_new;
+    MatchedSet old_matched;
+    old_matched.reset(n);
+
+    const double cv_fill = seconds(rounds, [&] {
+        for (auto* out : { &cv_old, &cv_new }) {
+            const std::vector<cv::Rect>& areas = out == &cv_old ? old_areas : new_areas;
+            out->clear();
+            parallel_for(0, n, [&](const i32 i) { out->push_back(make_segment(areas[i], i)); });
+        }
+    });
+    const double std_fill = seconds(rounds, [&] {
+        for (auto* out : { &std_old, &std_new }) {
+            const std::vector<cv::Rect>& areas = out == &std_old ? old_areas : new_areas;
+            out->clear();
+            out->reserve(n);
+            for (i32 i = 0; i < n; i++)
+                out->push_back(make_segment(areas[i], i));
+        }
+    });
+
+    i64 cv_result = 0, std_result = 0;
+    const double cv_scan = seconds(rounds, [&] { cv_result = scan(cv_old, cv_new, old_matched); });
+    const double std_scan = seconds(rounds, [&] { std_result = scan(std_old, std_new, old_matched); });
+    const double cv_lookup = seconds(rounds, [&] { cv_result += lookup(cv_old, candidates); });
+    const double std_lookup = seconds(rounds, [&] { std_result += lookup(std_old, candidates); });
+
+    // concurrent_vector fills in whatever order the threads push, so only
+    // the scan results can be compared
+    if (scan(cv_old, cv_new, old_matched) != scan(std_old, std_new, old_matched)) {
+        std::cerr << "bench_segments: the containers disagree" << std::endl;
+        return 1;
+    }
+
+    auto row = [&](const char* name, const double a, const double b, const i64 ops) {
+        std::cout << std::setw(8) << name << std::fixed << std::setprecision(2) << std::setw(18) << a * 1e9 / ops
+                  << std::setw(14) << b * 1e9 / ops << std::setw(10) << a / b << "x\n";
+    };
+    std::cout << n << " segments per image, best of " << rounds << " rounds, ns per element\n";
+    std::cout << std::setw(8) << "" << std::setw(18) << "concurrent_vector" << std::setw(14) << "std::vector" << std::setw(11) << "ratio\n";
+    row("fill", cv_fill, std_fill, 2 * static_cast<i64>(n));
+    row("scan", cv_scan, std_scan, static_cast<i64>(n) * n);
+    row("lookup", cv_lookup, std_lookup, static_cast<i64>(candidates.size()));
+
+    // keeps the loops from being optimized away
+    static volatile i64 sink;
+    sink = cv_result + std_result;
+    return 0;
+}
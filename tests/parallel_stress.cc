@@ -0,0 +1,140 @@
+#include "gazosan.h"
+
+// Exercises the parallel primitives of gazosan.h the way the comparison
+// nests them, to be run under ThreadSanitizer in both builds: on the
+// ThreadPool, and on TBB with ENABLE_PARALLEL.
+//
+// usage: parallel_stress [rounds]
+
+using namespace gazosan;
+
+static bool fail(const std::string& what)
+{
+    std::cerr << "parallel_stress: " << what << std::endl;
+    return false;
+}
+
+// parallel_for inside parallel_for, and parallel_for_each inside TaskGroup
+static bool nested_loops()
+{
+    std::vector<i32> values(1000);
+    std::atomic<i64> sum = 0;
+    parallel_for(0, 1000, [&](const i32 i) {
+        std::atomic<i32> inner = 0;
+        parallel_for(0, 10, [&](const i32 j) { inner += j; });
+        values[i] = inner;
+        sum += i;
+    });
+
+    std::atomic<i32> found = 0;
+    TaskGroup tg;
+    for (i32 k = 0; k < 50; k++) {
+        tg.run([&] {
+            parallel_for_each(values, [&](const i32& x) {
+                if (x == 45)
+                    found++;
+            });
+        });
+    }
+    tg.wait();
+
+    if (sum != 499500 || found != 50 * 1000)
+        return fail("nested loops lost iterations");
+    return true;
+}
+
+static bool thread_local_values()
+{
+    ThreadLocal<i64> counts;
+    parallel_for(0, 10000, [&](i32) { counts.local()++; });
+    i64 total = 0;
+    counts.for_each([&](const i64 count) { total += count; });
+    if (total != 10000)
+        return fail("ThreadLocal lost increments");
+    return true;
+}
+
+// the first stage must see the items in order, and no more than
+// `max_in_flight` of them may be between the first and the last stage
+static bool pipeline()
+{
+    constexpr i64 n = 200;
+    constexpr i64 max_in_flight = 3;
+    std::atomic<i64> in_flight = 0;
+    std::atomic<i64> peak = 0;
+    std::vector<i64> order;
+    std::vector<i32> seen(n);
+
+    std::vector<std::function<void(i64)>> stages;
+    stages.emplace_back([&](const i64 i) {
+        order.push_back(i);
+        const i64 now = ++in_flight;
+        for (i64 max = peak; now > max && !peak.compare_exchange_weak(max, now);) { }
+    });
+    stages.emplace_back([&](const i64 i) {
+        parallel_for(0, 10, [](i32) { });
+        seen[i]++;
+    });
+    stages.emplace_back([&](const i64 i) {
+        seen[i]++;
+        in_flight--;
+    });
+    parallel_pipeline(n, max_in_flight, stages);
+
+    for (i64 i = 0; i < n; i++) {
+        if (order[i] != i || seen[i] != 2)
+            return fail("pipeline skipped or reordered an item");
+    }
+    if (peak > max_in_flight)
+        return fail("pipeline exceeded max_in_flight");
+    return true;
+}
+
+// Old segments compete for identical new ones the way match_segments claims
+// them: every old segment tries the candidates in the same order and keeps
+// the first one it wins. The assignment must come out one-to-one.
+static bool claim_matches()
+{
+    constexpr i32 n = 500;
+    MatchedSet old_matched, new_matched;
+    old_matched.reset(n);
+    new_matched.reset(n);
+    std::vector<i32> partner(n, -1);
+
+    parallel_for(0, n, [&](const i32 i) {
+        for (i32 j = 0; j < n; j++) {
+            if (new_matched.test(j) || !claim_match(old_matched, i, new_matched, j))
+                continue;
+            partner[i] = j;
+            break;
+        }
+    });
+
+    std::vector<i32> claims(n);
+    for (i32 i = 0; i < n; i++) {
+        if (partner[i] < 0 || !old_matched.test(i))
+            return fail("an old segment got no match");
+        if (claims[partner[i]]++)
+            return fail("a new segment was matched twice");
+    }
+    for (i32 j = 0; j < n; j++) {
+        if (!new_matched.test(j))
+            return fail("a new segment was claimed without a partner");
+    }
+    return true;
+}
+
+int main(const int argc, char** argv)
+{
+    const i32 rounds = argc > 1 ? std::stoi(argv[1]) : 100;
+#ifndef ENABLE_PARALLEL
+    ThreadPool::instance().start(8);
+#endif
+
+    for (i32 round = 0; round < rounds; round++) {
+        if (!nested_loops() || !thread_local_values() || !pipeline() || !claim_matches())
+            return 1;
+    }
+    std::cout << "ok" << std::endl;
+    return 0;
+}
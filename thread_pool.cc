@@ -0,0 +1,121 @@
+#include "gazosan.h"
+
+#ifndef ENABLE_PARALLEL
+
+namespace gazosan {
+
+static thread_local i32 current_queue = 0;
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::ThreadPool()
+{
+    queues.push_back(std::make_unique<Queue>());
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::scoped_lock lock(sleep_mu);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::start(const i32 threads)
+{
+    if (!workers.empty())
+        return;
+    for (i32 i = 1; i < threads; i++)
+        queues.push_back(std::make_unique<Queue>());
+    for (i32 i = 1; i < threads; i++)
+        workers.emplace_back([this, i] { work(i); });
+}
+
+i32 ThreadPool::current_index()
+{
+    return current_queue;
+}
+
+void ThreadPool::submit(Task task)
+{
+    {
+        Queue& q = *queues[current_queue];
+        std::scoped_lock lock(q.mu);
+        q.tasks.push_back(std::move(task));
+    }
+    {
+        std::scoped_lock lock(sleep_mu);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::notify_all()
+{
+    // taking the lock orders the notification after a waiter's last check
+    {
+        std::scoped_lock lock(sleep_mu);
+    }
+    wake.notify_all();
+}
+
+bool ThreadPool::run_one()
+{
+    const i32 n = size();
+    Task task;
+    for (i32 k = 0; k < n && !task; k++) {
+        Queue& q = *queues[(current_queue + k) % n];
+        std::scoped_lock lock(q.mu);
+        if (q.tasks.empty())
+            continue;
+        // our own newest task is the most likely to be in cache, the oldest
+        // task of another thread the most likely to be a large piece of work
+        if (k == 0) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+    }
+    if (!task)
+        return false;
+
+    queued--;
+    task();
+    return true;
+}
+
+void ThreadPool::wait_until(const std::function<bool()>& done)
+{
+    while (!done()) {
+        if (run_one())
+            continue;
+        std::unique_lock lock(sleep_mu);
+        wake.wait(lock, [&] { return done() || queued > 0; });
+    }
+}
+
+void ThreadPool::work(const i32 index)
+{
+    current_queue = index;
+    for (;;) {
+        if (run_one())
+            continue;
+        std::unique_lock lock(sleep_mu);
+        wake.wait(lock, [&] { return queued > 0 || stopping; });
+        if (stopping && queued == 0)
+            return;
+    }
+}
+
+} // namespace gazosan
+
+#endif